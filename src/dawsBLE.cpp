@@ -38,29 +38,76 @@
 
 #define DEBUG false ///< enable BLE debug output to IDE Monitor
 
+/**
+ @brief Hex character value
+ 
+ Converts a single hex digit to its value.  Used at compile time when building the UUID table.
+ 
+ @param c - hex digit (upper or lower case)
+ 
+ @return the value 0 - 15
+ */
+constexpr uint8_t BLEcore::_hexVal(char c)
+{
+    return((c >= 'a')?(c - 'a' + 10):((c >= 'A')?(c - 'A' + 10):(c - '0')));
+}
+
+/**
+ @brief Parse a long UUID string
+ 
+ Converts a UUID in the standard text format (MSB first, '-' separators ignored) to its binary form, LSB first.
+ This is constexpr so the UUID table is built by the compiler and no parsing is done at run time.
+ 
+ @param s - the UUID string
+ 
+ @return the UUID in binary form
+ */
+constexpr dawsUUID128_t BLEcore::_parseUUID(const char* s)
+{
+    dawsUUID128_t u = {};
+    unsigned int n = 0;   // count of hex digits processed
+    
+    for (; (*s != '\0') && (n < 2 * UUID::LENGTH_OF_LONG_UUID); s++)
+    {
+        if (*s != '-')
+        {
+            // first digit of the string goes in the top nibble of the last byte
+            u.b[UUID::LENGTH_OF_LONG_UUID - 1 - n / 2] |= (n & 1)?_hexVal(*s):(_hexVal(*s) << 4);
+            n++;
+        }
+    }
+    return(u);
+}
+
 // long UUIDs uniquely assigned to this project are defined here
 // short UUIDs allocated as defined in the relevant Bluetooth documentation
 // are embedded in code
 // n.b. the uniqueness of these long UUIDs is assumed as result of their generation
 // mechanism - they are not registered in anyway.
 // version 4 uuids got from www.uuidgenerator.net 28/1/2021
-const char BLEcore::_pointServUUID[] =
-    "875e6ef1-7e3f-4e57-86e1-9a921002b8e9";  ///< point service UUID
-const char BLEcore::_idUUID[] =
-    "8dbe4bf8-b166-4d52-bd7e-56cd5eb6c246"; ///< id characteristic UUID
-const char BLEcore::_stateUUID[] =
-    "068a007d-9f09-49f0-907c-2d54178147b8"; ///< state characteristic UUID
-const char BLEcore::_cmdUUID[] =
-    "3d59437d-265e-4698-9b4f-3852e8ed2b33"; ///<command characteristic UUID
+constexpr dawsUUID128_t BLEcore::_pointServUUID =
+    _parseUUID("875e6ef1-7e3f-4e57-86e1-9a921002b8e9");  ///< point service UUID
+constexpr dawsUUID128_t BLEcore::_ctlServUUID =
+    _parseUUID("530faf0a-8dfe-41bf-9443-380a6f32a9b7");  ///< accessory controller service UUID
 
-const char* BLEcore::_characUUID[] = {BLEcore::_idUUID,
-    BLEcore::_stateUUID, BLEcore::_cmdUUID};
+constexpr dawsUUID128_t BLEcore::_characUUID[MAX_UUID] =
+{
+    _parseUUID("8dbe4bf8-b166-4d52-bd7e-56cd5eb6c246"), // id characteristic UUID
+    _parseUUID("068a007d-9f09-49f0-907c-2d54178147b8"), // state characteristic UUID
+    _parseUUID("3d59437d-265e-4698-9b4f-3852e8ed2b33"), // command characteristic UUID
+    _parseUUID("c899f406-162f-41c3-96f2-e11991575652"), // aggregated state characteristic UUID
+    _parseUUID("ccc9628c-4125-4ae2-9bfb-95d923859391")  // route command characteristic UUID
+};
 
 
 const ReporterType BLEcore::_type = BLE_REP;
 
 BLEcore* BLEcore::_thisBLEcore = nullptr;
 
+const uint8_t DAWS_CONFIG_SIG = 0;  // configuration check - named from the library's capacities, see dawsConfig.h
+
+static_assert(ROUTE_SIZE(MAX_ROUTE_STEPS) <= ATT_MAX_VALUE_SIZE, "route command exceeds the ATT attribute size - reduce MAX_ROUTE_STEPS");
+
 
 
 
@@ -86,10 +133,30 @@ _bleTaskThread(BLE_PRIORITY), Reporter(BLE_REP)
 {
     _devName = devName;
     _evQp = evqp;
+#if DAWS_PERIPHERAL && DAWS_CENTRAL
     _periMode = periMode;
+#else
+    _periMode = DAWS_PERIPHERAL;  // fixed by the build role
+    (void)periMode;
+#endif
+    _setupDone = false;
+    _conCount = 0;
+#if DAWS_PERIPHERAL
+    _onPeriConnChange = nullptr;
+#endif
+#if DAWS_CENTRAL
     _onCentralConnect = nullptr;
     _onCentralDisconnect = nullptr;
-    _setupDone = false;
+    for (int i = 0; i < MAX_PENDING_CON; i++)
+    {
+        _pendingCon[i].owner = nullptr;
+    }
+    _pendingOrder = 0;
+    for (int i = 0; i < MAX_CONN_OWNER; i++)
+    {
+        _connOwner[i].owner = nullptr;
+    }
+#endif
     
     _ledp = nullptr;
 
@@ -127,10 +194,30 @@ _bleTaskThread(BLE_PRIORITY), Reporter(BLE_REP)
 {
     _devName = devName;
     _evQp = evqp;
+#if DAWS_PERIPHERAL && DAWS_CENTRAL
     _periMode = periMode;
+#else
+    _periMode = DAWS_PERIPHERAL;  // fixed by the build role
+    (void)periMode;
+#endif
+    _setupDone = false;
+    _conCount = 0;
+#if DAWS_PERIPHERAL
+    _onPeriConnChange = nullptr;
+#endif
+#if DAWS_CENTRAL
     _onCentralConnect = nullptr;
     _onCentralDisconnect = nullptr;
-    _setupDone = false;
+    for (int i = 0; i < MAX_PENDING_CON; i++)
+    {
+        _pendingCon[i].owner = nullptr;
+    }
+    _pendingOrder = 0;
+    for (int i = 0; i < MAX_CONN_OWNER; i++)
+    {
+        _connOwner[i].owner = nullptr;
+    }
+#endif
     
     _ledp = ledp;
 
@@ -277,6 +364,19 @@ BLEcore& BLEcore::instance()
     return ((BLEcore&)(*_thisBLEcore));
 }
 
+/**
+ @brief Expose the BLE event queue
+ 
+ This is the queue dispatched by the BLE task.  It may be used to defer BLE actions, e.g. to retry a
+ GATT operation when the stack is busy.
+ 
+ @return pointer to the event queue
+ */
+events::EventQueue* BLEcore::getEventQueue()
+{
+    return(_evQp);
+}
+
 /**
  @brief get the number of open connections
  
@@ -307,6 +407,7 @@ void BLEcore::_scheduleBLEevents(BLE::OnEventsToProcessCallbackContext *context)
  
  @param event - Advertising end event.
  */
+#if DAWS_PERIPHERAL
 void BLEcore::onAdvertisingEnd(const ble::AdvertisingEndEvent& event)
 {
 #if DEBUG
@@ -324,6 +425,7 @@ void BLEcore::onAdvertisingEnd(const ble::AdvertisingEndEvent& event)
     }
 #endif
 }
+#endif
 /**
  @brief Retrieve the UUID for the given index
  
@@ -334,22 +436,26 @@ void BLEcore::onAdvertisingEnd(const ble::AdvertisingEndEvent& event)
  */
 UUID BLEcore::getUUID(uuid_t u)
 {
-    return UUID(_characUUID[u]);
+    return UUID(_characUUID[u].b, UUID::LSB);
 }
 /**
  @brief Match UUID
  The provided UUID is matched against the core list of UUIDs in use.
- MAX_UUID is returned if no match.
+ MAX_UUID is returned if no match.  Short UUIDs never match.
  
  @param uuid - the UUID to be matched
  
  @return the index number found or MAX_UUID
  */
-uuid_t BLEcore::matchUUID(UUID uuid)
+uuid_t BLEcore::matchUUID(const UUID& uuid)
 {
     int u = 0;
     
-    while ((UUID(_characUUID[u]) != uuid) && (u < MAX_UUID))
+    if (uuid.shortOrLong() != UUID::UUID_TYPE_LONG)
+    {
+        return(MAX_UUID);
+    }
+    while ((u < MAX_UUID) && !_match128(uuid.getBaseUUID(), _characUUID[u]))
     {
         u++;
     }
@@ -366,19 +472,246 @@ uuid_t BLEcore::matchUUID(UUID uuid)
  */
 UUID BLEcore::getServUUID()
 {
-    return UUID(_pointServUUID);
+    static_assert((_pointServUUID.b[0] == 0xe9) &&
+                  (_pointServUUID.b[UUID::LENGTH_OF_LONG_UUID - 1] == 0x87),
+                  "UUIDs must be held LSB first");
+    return UUID(_pointServUUID.b, UUID::LSB);
+}
+
+/**
+ @brief Test for the service UUID
+ 
+ This checks whether the given UUID is the accessory service UUID.
+ 
+ @param uuid - the UUID to be checked
+ 
+ @return true if it is the accessory service UUID
+ */
+bool BLEcore::isServUUID(const UUID& uuid)
+{
+    return((uuid.shortOrLong() == UUID::UUID_TYPE_LONG) &&
+           _match128(uuid.getBaseUUID(), _pointServUUID));
+}
+
+/**
+ @brief Test raw bytes for the service UUID
+ 
+ This checks whether 16 bytes, LSB first, as found in an advertising report hold the accessory
+ service UUID.  The bytes need not be aligned.
+ 
+ @param up - pointer to the UUID bytes
+ 
+ @return true if they match the accessory service UUID
+ */
+bool BLEcore::isServUUID(const uint8_t* up)
+{
+    return(_match128(up, _pointServUUID));
+}
+
+/**
+ @brief Exposes the controller service UUID
+ 
+ This returns the UUID of the optional accessory controller service.  There is at most one instance on
+ each controller.  It holds characteristics covering all the controller's accessories.
+ 
+ @return the accessory controller service UUID
+ */
+UUID BLEcore::getCtlServUUID()
+{
+    return UUID(_ctlServUUID.b, UUID::LSB);
+}
+
+/**
+ @brief Test for the controller service UUID
+ 
+ @param uuid - the UUID to be checked
+ 
+ @return true if it is the accessory controller service UUID
+ */
+bool BLEcore::isCtlServUUID(const UUID& uuid)
+{
+    return((uuid.shortOrLong() == UUID::UUID_TYPE_LONG) &&
+           _match128(uuid.getBaseUUID(), _ctlServUUID));
+}
+
+// compare a long UUID a word at a time
+// memcpy is used for the candidate as it may not be aligned - the compiler
+// reduces this to word loads
+bool BLEcore::_match128(const uint8_t* up, const dawsUUID128_t& ref)
+{
+    uint32_t w[UUID::LENGTH_OF_LONG_UUID / sizeof(uint32_t)];
+    uint32_t r[UUID::LENGTH_OF_LONG_UUID / sizeof(uint32_t)];
+    
+    memcpy(w, up, sizeof(w));
+    memcpy(r, ref.b, sizeof(r));
+    return((w[0] == r[0]) && (w[1] == r[1]) && (w[2] == r[2]) && (w[3] == r[3]));
+}
+
+#if DAWS_PERIPHERAL
+/**
+ @brief Set the peripheral connection callback.
+ 
+ This sets the callback to be executed when a client initiated connection to this peripheral opens and when any
+ connection closes.  Services use it to forget per connection state.
+ 
+ @param cb - the callback to be executed, given the connection handle.
+ */
+void BLEcore::setPeripheralConnCallback(mbed::Callback<void(const ble::connection_handle_t)> cb)
+{
+    _onPeriConnChange = cb;
+}
+#endif
+
+#if DAWS_CENTRAL
+/**
+ @brief Initiate a central connection with an owner
+ 
+ This initiates a connection to the given peer.  The owner is recorded against the peer address until the
+ connection completes and then against the connection handle, so connection and disconnection events go
+ straight to the owner.  Several owners may have connections open, or pending, at once.
+ 
+ @param peerAddType - the peer address type
+ @param peerAdd - the peer address
+ @param conParams - connection parameters
+ @param owner - the object to receive the connection events
+ 
+ @return BLE error code - BLE_ERROR_NO_MEM if too many connects are already pending
+ */
+ble_error_t BLEcore::connect(const ble::peer_address_type_t peerAddType,
+                             const ble::address_t& peerAdd,
+                             const ble::ConnectionParameters& conParams,
+                             BLEConnOwner* owner)
+{
+    ble_error_t bleErr;
+    int i = 0;
+    
+    // the caller may not be on the BLE thread so the entry is claimed and filled before the connect
+    // is issued - the completion may be processed before the connect call returns
+    core_util_critical_section_enter();
+    while ((i < MAX_PENDING_CON) && (_pendingCon[i].owner != nullptr))
+    {
+        i++;
+    }
+    if (i < MAX_PENDING_CON)
+    {
+        _pendingCon[i].peerAdd = peerAdd;
+        _pendingCon[i].peerAddType = peerAddType;
+        _pendingCon[i].order = _pendingOrder++;
+        _pendingCon[i].owner = owner;
+    }
+    core_util_critical_section_exit();
+    if (i == MAX_PENDING_CON)
+    {
+        return(BLE_ERROR_NO_MEM);
+    }
+    bleErr = _gap.connect(peerAddType, peerAdd, conParams);
+    if (bleErr != BLE_ERROR_NONE)
+    {
+        core_util_critical_section_enter();
+        _pendingCon[i].owner = nullptr;  // no completion will come
+        core_util_critical_section_exit();
+    }
+    return(bleErr);
+}
+
+/**
+ @brief Get the owner of a connection
+ 
+ @param ch - connection handle
+ 
+ @return the owner of the connection or nullptr if it has none (e.g. a peripheral connection)
+ */
+BLEConnOwner* BLEcore::getConnOwner(const ble::connection_handle_t ch)
+{
+    for (int i = 0; i < MAX_CONN_OWNER; i++)
+    {
+        if ((_connOwner[i].owner != nullptr) && (_connOwner[i].connHandle == ch))
+        {
+            return(_connOwner[i].owner);
+        }
+    }
+    return(nullptr);
+}
+
+// find and remove the pending connect matching the connection event
+// a failed connect may not carry the peer address - if so the oldest pending connect is taken
+BLEConnOwner* BLEcore::_takePending(const ble::ConnectionCompleteEvent& event)
+{
+    BLEConnOwner* owner = nullptr;
+    int found = -1;
+    
+    core_util_critical_section_enter();
+    for (int i = 0; (i < MAX_PENDING_CON) && (found < 0); i++)
+    {
+        if ((_pendingCon[i].owner != nullptr) &&
+            (_pendingCon[i].peerAddType == event.getPeerAddressType()) &&
+            (_pendingCon[i].peerAdd == event.getPeerAddress()))
+        {
+            found = i;
+        }
+    }
+    if ((found < 0) && (event.getStatus() != BLE_ERROR_NONE))
+    {
+        for (int i = 0; i < MAX_PENDING_CON; i++)
+        {
+            if ((_pendingCon[i].owner != nullptr) &&
+                ((found < 0) || ((int16_t)(_pendingCon[i].order - _pendingCon[found].order) < 0)))
+            {
+                found = i;  // older than any found so far
+            }
+        }
+    }
+    if (found >= 0)
+    {
+        owner = _pendingCon[found].owner;
+        _pendingCon[found].owner = nullptr;
+    }
+    core_util_critical_section_exit();
+    return(owner);
+}
+
+// record the owner of a newly open connection
+bool BLEcore::_setConnOwner(const ble::connection_handle_t ch, BLEConnOwner* owner)
+{
+    for (int i = 0; i < MAX_CONN_OWNER; i++)
+    {
+        if (_connOwner[i].owner == nullptr)
+        {
+            _connOwner[i].connHandle = ch;
+            _connOwner[i].owner = owner;
+            return(true);
+        }
+    }
+    return(false);
+}
+
+// remove and return the owner of a closed connection
+BLEConnOwner* BLEcore::_releaseConnOwner(const ble::connection_handle_t ch)
+{
+    BLEConnOwner* owner;
+    for (int i = 0; i < MAX_CONN_OWNER; i++)
+    {
+        if ((_connOwner[i].owner != nullptr) && (_connOwner[i].connHandle == ch))
+        {
+            owner = _connOwner[i].owner;
+            _connOwner[i].owner = nullptr;
+            return(owner);
+        }
+    }
+    return(nullptr);
 }
 
 /**
  @brief Set the central connect callback.
  
  This sets the callback to the client to be executed when a client initiated (central) connection
- completes.
+ completes, successfully or not.  The event status shows which.  It is only used for connections
+ that were not initiated through connect() with an owner.
  
  @param cb - the callback to be executed.
  */
 void BLEcore::setConnectionCompleteCallback
- (mbed::Callback<void(const ble::connection_handle_t)> cb)
+ (mbed::Callback<void(const ble::ConnectionCompleteEvent&)> cb)
 {
     _onCentralConnect = cb;
 }
@@ -387,7 +720,7 @@ void BLEcore::setConnectionCompleteCallback
  @brief Set the central disconnect callback.
  
  This sets the callback to the client to be executed when a client (central) disconnection
- completes.
+ completes.  It is only used for connections that have no owner.
  
  @param cb - the callback to be executed.
  */
@@ -409,13 +742,16 @@ void BLEcore::setScanEventCallback
 {
     _onScanAdReport = cb;
 }
+#endif
 
 
 /**
  @brief Connection complete call back
  
  Handle the new connection.  The connection is always client initiated.  If we are client side, we will have initiated the
- connect and the client needs to be informed of the event.
+ connect and the owner of the connect needs to be informed of the event.  The owner is found from the pending
+ connects by peer address and is recorded against the new connection handle.  The owner is also informed if the
+ connection failed so it can tidy up.
  
  If we are server side, the client will write or initiate notifications.  These will be handled by the service.
  
@@ -427,6 +763,9 @@ void BLEcore::setScanEventCallback
 void BLEcore::onConnectionComplete(const ble::ConnectionCompleteEvent& event)
 {
     ble_error_t bleErr = event.getStatus();
+#if DAWS_CENTRAL
+    BLEConnOwner* owner = nullptr;
+#endif
 
     
 #if DEBUG
@@ -447,23 +786,56 @@ void BLEcore::onConnectionComplete(const ble::ConnectionCompleteEvent& event)
             *_ledp = 0;     // turn led on
         }
         
-        
-        if ((event.getOwnRole() == ble::connection_role_t::CENTRAL) &&
-            (_onCentralConnect != nullptr))
+#if DAWS_PERIPHERAL
+        if ((event.getOwnRole() == ble::connection_role_t::PERIPHERAL) &&
+            (_onPeriConnChange != nullptr))
         {
-            // execute call back (to connection object)
-            _onCentralConnect(event.getConnectionHandle());
-            queueReport(BLE_CONNECTED, event.getConnectionHandle());
+            _onPeriConnChange(event.getConnectionHandle());
+        }
+#endif
+#if DAWS_CENTRAL
+        if (event.getOwnRole() == ble::connection_role_t::CENTRAL)
+        {
+            owner = _takePending(event);
+            if (owner != nullptr)
+            {
+                // pass straight to the owner and route the connection's events to it from now on
+                _setConnOwner(event.getConnectionHandle(), owner);
+                owner->onConnected(event);
+                queueReport(BLE_CONNECTED, event.getConnectionHandle());
+            }
+            else if (_onCentralConnect != nullptr)
+            {
+                // execute call back (to connection object)
+                _onCentralConnect(event);
+                queueReport(BLE_CONNECTED, event.getConnectionHandle());
+            }
+        }
+#endif
+    }
+#if DAWS_CENTRAL
+    else
+    {
+        // only a connection we initiated can fail here
+        owner = _takePending(event);
+        if (owner != nullptr)
+        {
+            owner->onConnected(event);
+        }
+        else if (_onCentralConnect != nullptr)
+        {
+            _onCentralConnect(event);
         }
     }
+#endif
     
 }
 
 /**
  @brief Disconnection complete call back
  
- Restart advertising if peripheral.  If there's a central connection callback, invoke it.
- The called back routine must check that it's for it!
+ Restart advertising if peripheral.  If the connection has an owner, inform it.  Otherwise if there's a central
+ connection callback, invoke it.  The called back routine must check that it's for it!
  
  @note This overrides the virtual routine in the GAP interface.
 
@@ -473,7 +845,6 @@ void BLEcore::onConnectionComplete(const ble::ConnectionCompleteEvent& event)
  */
 void BLEcore::onDisconnectionComplete(const ble::DisconnectionCompleteEvent& event)
 {
-    ble_error_t bleErr;
     if ((--_conCount == 0) && (_ledp != nullptr))   // if closing the last connection
     {
         *_ledp = 1;     // turn led off
@@ -484,8 +855,14 @@ void BLEcore::onDisconnectionComplete(const ble::DisconnectionCompleteEvent& eve
     //Serial.println((const uint8_t)event.getReason());
 
 #endif
+#if DAWS_PERIPHERAL
+    if (_onPeriConnChange != nullptr)
+    {
+        _onPeriConnChange(event.getConnectionHandle());  // may be a central connection - no harm
+    }
     if (_periMode)
     {
+        ble_error_t bleErr;
 #if DEBUG
         Serial.println(_gap.isAdvertisingActive(ble::LEGACY_ADVERTISING_HANDLE)?
                        "Still advertising":"Advertising is stopped");
@@ -505,21 +882,60 @@ void BLEcore::onDisconnectionComplete(const ble::DisconnectionCompleteEvent& eve
         }
 #endif
     }
-    if (_onCentralDisconnect != nullptr)
+#endif
+#if DAWS_CENTRAL
+    BLEConnOwner* owner = _releaseConnOwner(event.getConnectionHandle());
+    if (owner != nullptr)
+    {
+        owner->onDisconnected(event);
+        queueReport(BLE_DISCONNECTED, event.getConnectionHandle());
+    }
+    else if (_onCentralDisconnect != nullptr)
     {
 
         _onCentralDisconnect(event);    // execute call back
         queueReport(BLE_DISCONNECTED, event.getConnectionHandle());
     }
+#endif
 
     
 }
 
 
+#if DAWS_CENTRAL
+/**
+ @brief Connection parameters update complete call back
+ 
+ A connection parameter update has completed (or failed).  If the connection has an owner it is informed so it can
+ note the parameters now in use.
+ 
+ @note This overrides the virtual routine in the GAP interface.
+ 
+ @param event - connection parameters update complete event
+ */
+void BLEcore::onConnectionParametersUpdateComplete
+(const ble::ConnectionParametersUpdateCompleteEvent& event)
+{
+    BLEConnOwner* owner = getConnOwner(event.getConnectionHandle());
+#if DEBUG
+    Serial.print("Connection parameters update status ");
+    Serial.print(event.getStatus());
+    Serial.print(" interval ");
+    Serial.println(event.getConnectionInterval().value());
+#endif
+    if (owner != nullptr)
+    {
+        owner->onParamsUpdated(event);
+    }
+}
+#endif
+
+
 // init complete start advertising if needed
 void BLEcore::_onInitComplete(BLE::InitializationCompleteCallbackContext *params)
 {
 
+#if DAWS_PERIPHERAL
     ble_error_t bleErr;
     ble::AdvertisingParameters advParams
     (
@@ -530,7 +946,8 @@ void BLEcore::_onInitComplete(BLE::InitializationCompleteCallbackContext *params
     ble::AdvertisingDataBuilder advDataBuilder
     (_advBuffer, ble::LEGACY_ADVERTISING_MAX_SIZE);
     
-    const UUID suuid[] = {UUID(_pointServUUID)};
+    const UUID suuid[] = {getServUUID()};
+#endif
     
     //mbed::Span<const UUID> uuidSpan(suuid,1);
     
@@ -569,6 +986,7 @@ void BLEcore::_onInitComplete(BLE::InitializationCompleteCallbackContext *params
             }
         }
 #endif
+#if DAWS_PERIPHERAL
         if(_periMode)
         {
             // set default flags - discoverable and only BLE capable
@@ -609,10 +1027,12 @@ void BLEcore::_onInitComplete(BLE::InitializationCompleteCallbackContext *params
             }
 #endif
         }
+#endif
     }
 }
 
 
+#if DAWS_CENTRAL
 /**
  @brief Start a scanning sequence.
  
@@ -734,6 +1154,7 @@ void BLEcore::onScanTimeout(const ble::ScanTimeoutEvent& event)
 #endif
     queueReport(BLE_SCAN_DONE, 0);
 }
+#endif
 
 /**
  @brief Print a UUID
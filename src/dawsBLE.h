@@ -27,13 +27,19 @@
 #ifndef ____dawsBLE__
 #define ____dawsBLE__
 
+// the capacities and role are shared by all the library headers and sources - see dawsConfig.h
+#include "dawsConfig.h"
 
 //#define ID_ATTRIBUTE_COUNT 1
 //#define STATE_ATTRIBUTE_COUNT 1
 //#define CMD_ATTRIBUTE_COUNT 1
 //#define MAX_ACC_CHARACTERISTIC_COUNT 9
 
-#define MAX_ID_SIZE 10 ///< maximum size for identifier strings
+#define NO_CONN_HANDLE 0xFFFF ///< connection handle when not connected (HCI handles are 12 bits)
+#define ROUTE_STEP_SIZE 3  ///< route step - command value handle (LSB first) and command
+#define ROUTE_SIZE(n) (1 + (n) * ROUTE_STEP_SIZE) ///< route command size - step count and n steps
+#define ATT_MAX_VALUE_SIZE 512 ///< largest attribute value allowed by ATT
+#define ATT_DEFAULT_NOTIFY_SIZE 20 ///< largest notification value at the default ATT MTU of 23 - no MTU exchange is done
 
 
 /**
@@ -49,6 +55,7 @@ enum RemDevState_t :byte
     CS_CON_DISC, ///< connected - discovery in progress
     CS_CON_INIT, ///< connected - initial reads and set up notifications etc
     CS_RECON_INIT, ///< re-connected - set up notifications only
+    CS_CACHE_CHECK, ///< connected - checking handles restored from the handle cache
     CS_CONNECTED, ///< connected and discovery complete
     CS_DISCONNECTING, ///< local disconnect command issued
     CS_DISCON,       ///< disconnected but discovered characteristics retained.
@@ -70,11 +77,56 @@ enum uuid_t :byte
     ID_UUID         = 0, ///< daws service identifier (read only)
     STATE_UUID      = 1, ///< daws state variable (notify)
     CMD_UUID        = 2, ///< daws command (read/write)
-    MAX_UUID        = 3 ///< boundary value for size etc
+    AGG_STATE_UUID  = 3, ///< daws controller aggregated state (read/notify)
+    ROUTE_UUID      = 4, ///< daws controller route command (write)
+    MAX_UUID        = 5 ///< boundary value for size etc
     
     
 };
 
+/**
+ @brief Long (128 bit) UUID in binary form
+ 
+ The bytes are held LSB first - the same order as the UUID base bytes and as sent over the air.  Word aligned
+ so UUIDs can be compared a word at a time.
+ */
+struct dawsUUID128_t
+{
+    alignas(4) uint8_t b[UUID::LENGTH_OF_LONG_UUID]; ///< UUID bytes, LSB first
+};
+
+
+
+/**
+ @brief Owner of a central connection
+ 
+ An object that initiates a central connection through BLEcore::connect() becomes the owner of the connection.
+ The BLE core passes connection events directly to the owner, by peer address until the connection completes
+ and by connection handle thereafter.
+ */
+class BLEConnOwner
+{
+public:
+    /**
+     @brief Connection complete
+     
+     Called when the connect completes.  The event status shows whether it was successful.
+     */
+    virtual void onConnected(const ble::ConnectionCompleteEvent&) = 0;
+    /**
+     @brief Disconnection complete
+     
+     Called when the owned connection closes.
+     */
+    virtual void onDisconnected(const ble::DisconnectionCompleteEvent&) = 0;
+    /**
+     @brief Connection parameters updated
+     
+     Called when a connection parameter update on the owned connection completes.  The event status shows whether
+     it was successful.
+     */
+    virtual void onParamsUpdated(const ble::ConnectionParametersUpdateCompleteEvent&) = 0;
+};
 
 
 /**
@@ -87,6 +139,9 @@ enum uuid_t :byte
  
  It inherits from the GAP EventHandler class overriding virtual functions therein.
  
+ Only the code for the role selected by DAWS_BLE_ROLE is built.  In a single role build the peripheral mode
+ flag given to the constructor is overridden by the role.
+ 
 
  
  It uses the Mbed BLE API.
@@ -102,28 +157,48 @@ public:
     void setup() override;
     ReporterType getType() override;
     void startBLE();
-    bool scan();
     int getConnectionCount();
+#if DAWS_CENTRAL
+    bool scan();
+    ble_error_t connect(const ble::peer_address_type_t, const ble::address_t&,
+                        const ble::ConnectionParameters&, BLEConnOwner*);
+    BLEConnOwner* getConnOwner(const ble::connection_handle_t);
+#endif
+#if DAWS_PERIPHERAL
+    void setPeripheralConnCallback(mbed::Callback<void(const ble::connection_handle_t)>);
+#endif
+    events::EventQueue* getEventQueue();
     
     static BLEcore& instance();
     static UUID getUUID(uuid_t);
-    static uuid_t matchUUID(UUID);
+    static uuid_t matchUUID(const UUID&);
     static UUID getServUUID();
+    static bool isServUUID(const UUID&);
+    static bool isServUUID(const uint8_t*);
+    static UUID getCtlServUUID();
+    static bool isCtlServUUID(const UUID&);
     
     // virtual GAP routines declared here and defined in code
+    // those for a role not built are left to the GAP defaults
+#if DAWS_PERIPHERAL
     void onAdvertisingEnd(const ble::AdvertisingEndEvent&) override;
+#endif
     void onConnectionComplete(const ble::ConnectionCompleteEvent&) override;
     void onDisconnectionComplete(const ble::DisconnectionCompleteEvent&) override;
+#if DAWS_CENTRAL
     void onAdvertisingReport(const ble::AdvertisingReportEvent&) override;
     void onScanTimeout(const ble::ScanTimeoutEvent&) override;
+    void onConnectionParametersUpdateComplete
+    (const ble::ConnectionParametersUpdateCompleteEvent&) override;
 
     
     void setConnectionCompleteCallback
-    (mbed::Callback<void(const ble::connection_handle_t)>);
+    (mbed::Callback<void(const ble::ConnectionCompleteEvent&)>);
     void setDisconnectionCompleteCallback
     (mbed::Callback<void(const ble::DisconnectionCompleteEvent&)>);
     void setScanEventCallback
     (mbed::Callback<void(const ble::AdvertisingReportEvent&)>);
+#endif
     
     static void printUUID(UUID u);
     
@@ -142,19 +217,50 @@ private:
     
     uint16_t _conCount;           // number of connections
     
+#if DAWS_PERIPHERAL
+    // callback for peripheral connections opening or closing
+    mbed::Callback<void(const ble::connection_handle_t)> _onPeriConnChange;
+#endif
+#if DAWS_CENTRAL
     // callback for handling central connection
-    mbed::Callback<void(ble::connection_handle_t)> _onCentralConnect;
+    mbed::Callback<void(const ble::ConnectionCompleteEvent&)> _onCentralConnect;
     // callback for handling central disconnection
     mbed::Callback<void(const ble::DisconnectionCompleteEvent&)> _onCentralDisconnect;
     // callback for handling scan detected advertising report
     mbed::Callback<void(const ble::AdvertisingReportEvent&)> _onScanAdReport;
+    
+    // central connects in progress - keyed on peer address
+    struct PendingCon_t
+    {
+        ble::address_t peerAdd;                 // peer address
+        ble::peer_address_type_t peerAddType;   // peer address type
+        uint16_t order;                         // order issued - wraps
+        BLEConnOwner* owner;                    // nullptr if entry free
+    };
+    PendingCon_t _pendingCon[MAX_PENDING_CON];
+    uint16_t _pendingOrder;                     // order for the next connect
+    
+    // open connections - keyed on connection handle
+    struct ConnOwner_t
+    {
+        ble::connection_handle_t connHandle;    // connection handle
+        BLEConnOwner* owner;                    // nullptr if entry free
+    };
+    ConnOwner_t _connOwner[MAX_CONN_OWNER];
+    
+    BLEConnOwner* _takePending(const ble::ConnectionCompleteEvent&);
+    bool _setConnOwner(const ble::connection_handle_t, BLEConnOwner*);
+    BLEConnOwner* _releaseConnOwner(const ble::connection_handle_t);
+#endif
 
     
-    static const char _pointServUUID[]; // point server uuid
-    static const char _idUUID[]; // id characteristic uuid
-    static const char _stateUUID[]; // state characteristic uuid
-    static const char _cmdUUID[];   // command characteristic uuid
-    static const char* _characUUID[];  // array of UUIDs
+    static const dawsUUID128_t _pointServUUID; // point server uuid
+    static const dawsUUID128_t _ctlServUUID;   // accessory controller server uuid
+    static const dawsUUID128_t _characUUID[];  // array of characteristic UUIDs indexed by uuid_t
+    
+    static constexpr uint8_t _hexVal(char);
+    static constexpr dawsUUID128_t _parseUUID(const char*);
+    static bool _match128(const uint8_t*, const dawsUUID128_t&);
 
     
     bool _periMode;                  // true if in peripheral mode (i.e advertising etc)
@@ -163,7 +269,9 @@ private:
     
     void _scheduleBLEevents(BLE::OnEventsToProcessCallbackContext *);
     
+#if DAWS_PERIPHERAL
     uint8_t _advBuffer[ble::LEGACY_ADVERTISING_MAX_SIZE]; // advertising data buffer
+#endif
 };
 
 
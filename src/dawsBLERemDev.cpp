@@ -23,6 +23,7 @@
 /*!
  */
 #include <limits.h>
+#include <new>
 #include <Arduino.h>
 
 //#define BLE_ROLE_BROADCASTER true
@@ -47,6 +48,30 @@
 
 
 #define DEBUG false  ///< enable BLE debug output to IDE Monitor
+#define HANDLE_CACHE true  ///< save discovered handles so discovery can be skipped after power on
+#define HANDLE_CACHE_VERSION 4  ///< change if the cache layout changes
+#define TARGETED_DISCOVERY true  ///< discover only the device name and accessory services rather than everything
+#define AGG_STATE true  ///< use the controller's aggregated state, if it has one, rather than per accessory state
+
+#if HANDLE_CACHE
+#include <kvstore_global_api.h>
+#endif
+
+#if DAWS_CENTRAL  // client connections are central only
+
+// a characteristic rebuilt from its handles for descriptor discovery, which only needs the handles
+// the discovered characteristic has no public setters - as in the BLE stack it is set up through a subclass
+struct HandleCharac_t: DiscoveredCharacteristic
+{
+    HandleCharac_t(ble::connection_handle_t ch, GattAttribute::Handle_t valueH, GattAttribute::Handle_t lastH)
+    {
+        gattc = &BLE::Instance().gattClient();
+        connHandle = ch;
+        declHandle = valueH - 1;
+        valueHandle = valueH;
+        lastHandle = lastH;
+    }
+};
 
 /*
  ********************************************************
@@ -56,13 +81,49 @@
 
 
 
-BLERemDev* BLERemDev::_activeRemDev = nullptr;  ///< The currently active connection
+BLERemDev* BLERemDev::_activeRemDev = nullptr;  ///< The most recently connected remote device
+
+BLEPeer_t BLERemDev::_peerTab[PEER_TABLE_SIZE];  ///< peers found by scanning
+uint8_t BLERemDev::_peerOrder[MAX_PEER_COUNT];   ///< peer table slots in the order found
+int BLERemDev::_peerCount = 0;
 
-BLERemDev BLERemDev::_bleCon[MAX_REMOTE_CON];  // but only one used at the moment!
+BLERemDev BLERemDev::_bleCon[MAX_REMOTE_CON];  // any or all may be connected at once
 
 
 int BLERemDev::_bleConCount  = 0;
+
+// connection parameters indexed by profile
+// the supervision timeout must exceed (1 + latency) * max interval * 2
+const BLERemDev::ConnParams_t BLERemDev::_connParams[CP_MAX] =
+{
+    {6, 12, 0, 100},        // CP_LOW_LATENCY 7.5 - 15 ms, timeout 1 s
+    {80, 160, 0, 100},      // CP_STANDARD 100 - 200 ms, timeout 1 s
+    {160, 320, 4, 600}      // CP_LOW_POWER 200 - 400 ms, latency 4, timeout 6 s
+};
+
+static_assert((PEER_TABLE_SIZE & (PEER_TABLE_SIZE - 1)) == 0, "peer table size must be a power of 2");
+static_assert(PEER_TABLE_SIZE > MAX_PEER_COUNT, "peer table must always have a free slot");
+static_assert(MAX_PEER_COUNT <= UINT8_MAX, "peer order is held as bytes");
+static_assert(PEER_TABLE_SIZE <= UINT8_MAX + 1, "peer table slots are held as bytes");
+static_assert((MAX_DISCOVERED_ACCESSORY > 0) && (MAX_REMOTE_CON > 0), "client needs at least one connection and accessory");
+static_assert(MAX_ROUTE_STEPS <= UINT8_MAX, "route step count is held as a byte");
+static_assert(MAX_NAME_SIZE > 1, "local names need room for the terminator");
+static_assert(PEER_TABLE_SIZE * sizeof(BLEPeer_t) +
+              MAX_REMOTE_CON * sizeof(BLERemDev) +
+              ACC_POOL_SIZE * (sizeof(RemAccessory) + sizeof(AccSlot_t)) <= DAWS_CLI_RAM_BUDGET,
+              "client tables exceed DAWS_CLI_RAM_BUDGET - reduce the capacities or raise the budget");
 bool BLERemDev::_scanRepCBset = false;
+bool BLERemDev::_conCBset = false;
+
+int BLERemDev::_routeOutstanding = 0;   // route writes awaiting response
+volatile bool BLERemDev::_routeBusy = false;  // route being sent
+bool BLERemDev::_routeOK = false;       // all route writes accepted so far
+mbed::Callback<void(bool)> BLERemDev::_routeDoneCB;  // route completion callback
+
+AccSlot_t BLERemDev::_accSlot[ACC_POOL_SIZE];   // remote accessory pool
+alignas(RemAccessory) uint8_t BLERemDev::_accMem[ACC_POOL_SIZE][sizeof(RemAccessory)];
+int BLERemDev::_accInUse = 0;
+int BLERemDev::_accHighWater = 0;
 
 
 
@@ -72,8 +133,7 @@ bool BLERemDev::_scanRepCBset = false;
 /**
  @brief Construct the BLE client connection with given address
  
- Each client connection connects to a specifed server address (effectively pre-paired).  At the moment only one connection
- will be open at a time.  The first time the connection is opened after starting, service discovery is performed.  The address and address type are set up when the object it instantiated.
+ Each client connection connects to a specifed server address (effectively pre-paired).  The first time the connection is opened after starting, service discovery is performed.  The address and address type are set up when the object it instantiated.
  
  @param remoteAdd - the hardware address of the server for this connection
  @param remoteAddType - the remote device's address type
@@ -85,7 +145,22 @@ BLERemDev::BLERemDev(const uint8_t* remoteAdd,
     _peerAddType = remoteAddType;           // save remote address type
 //    _bleCore = bleCore;
     _countDA = 0;
-    _localName = "unknown";
+    strcpy(_localName, "unknown");
+    _connHandle = NO_CONN_HANDLE;
+    _connProfile = _reqProfile = CP_STANDARD;
+    _connInterval = 0;
+    _opHead = _opCount = 0;
+    _opInFlight = _retryPending = false;
+    _retryCount = 0;
+    _cacheWritePending = false;
+    _cacheValid = false;
+    _fillStep = 0;
+    _discPass = DP_NONE;
+    _aggStateH = _aggCCCDH = GattAttribute::INVALID_HANDLE;
+    _useAgg = false;
+    _routeH = GattAttribute::INVALID_HANDLE;
+    _routePending = false;
+    _firstRemAcc = _lastRemAcc = nullptr;
     _clientConState = CS_CONNECTABLE;  // available for connection
 }
 
@@ -93,8 +168,7 @@ BLERemDev::BLERemDev(const uint8_t* remoteAdd,
  @brief Construct the BLE client connection without address
  
  Each client connection connects to a different server address. The address will be determined by scanning.
- At the moment only one connection
- will be open at a time.  The first time the connection is opened after starting, service discovery is performed.
+ Several connections may be open at once.  The first time the connection is opened after starting, service discovery is performed.
  This constructs a void connection object.  It will be assigned to a specific remote device, as part of the scanning process.
  */
 BLERemDev::BLERemDev()
@@ -102,6 +176,22 @@ BLERemDev::BLERemDev()
     _peerAdd = ble::address_t();
 //    _bleCore = bleCore;
     _countDA = 0;
+    _localName[0] = '\0';
+    _connHandle = NO_CONN_HANDLE;
+    _connProfile = _reqProfile = CP_STANDARD;
+    _connInterval = 0;
+    _opHead = _opCount = 0;
+    _opInFlight = _retryPending = false;
+    _retryCount = 0;
+    _cacheWritePending = false;
+    _cacheValid = false;
+    _fillStep = 0;
+    _discPass = DP_NONE;
+    _aggStateH = _aggCCCDH = GattAttribute::INVALID_HANDLE;
+    _useAgg = false;
+    _routeH = GattAttribute::INVALID_HANDLE;
+    _routePending = false;
+    _firstRemAcc = _lastRemAcc = nullptr;
     _clientConState = CS_INITIAL; // not yet scanned
 }
 
@@ -118,8 +208,8 @@ void BLERemDev::setup()
 /**
  @brief Provide the pointer to the active remote device
  
- This makes the current active remote device availble. Typically the current BLE peripheral peer.
- It returns nullptr if there is no device active.
+ This makes the most recently connected remote device availble. Typically the current BLE peripheral peer.
+ Other remote devices may also be connected.  It returns nullptr if that device has since disconnected.
  
  @return pointer to the current remote device.
  */
@@ -148,16 +238,19 @@ void BLERemDev::setAdReporting()
 /**
  @brief Connect to a remote device identified by index
  
- This connects to a remote device that has a connection record allocated as identified by the index.
+ This connects to a remote device found by scanning as identified by the index (the order in which it was found).
+ A connection record is allocated the first time the device is connected.
  
  @note this is a static routine.
  */
 
 bool BLERemDev::connectByIndex(int index)
 {
-    if ((index < _bleConCount) && (index >= 0))
+    BLERemDev* remDev;
+    if ((index < _peerCount) && (index >= 0))
     {
-        return(_bleCon[index]._connect());
+        remDev = _assignRemDev(_peerTab[_peerOrder[index]]);
+        return((remDev != nullptr) && remDev->_connect());
     }
     else
     {
@@ -168,58 +261,258 @@ bool BLERemDev::connectByIndex(int index)
 /**
  @brief Connect to a remote device identified by local name
  
- This connects to a remote device that has a connection record allocated as local name.
+ This connects to a remote device found by scanning as identified by its local name.  If more than one device
+ has the same name the first found is used.
+ 
+ @param name - the local name as a null terminated string
  
  @note this is a static routine.
  */
 
-bool BLERemDev::connectByName(String& name)
+bool BLERemDev::connectByName(const char* name)
 {
     int i = 0;
-    while ((getLocalNameByIndex(i) != name) &&
-           (i < _bleConCount))
+    while ((i < _peerCount) &&
+           (strcmp(name, _peerTab[_peerOrder[i]].localName) != 0))
     {
         i++;
     }
-    if (i < _bleConCount)
+    return(connectByIndex(i));  // fails if not found
+}
+
+#if DAWS_STRING_API
+/**
+ @brief Connect to a remote device identified by local name
+ 
+ As above, with the name as a String.
+ 
+ @param name - the local name as a String
+ */
+bool BLERemDev::connectByName(const String& name)
+{
+    return(connectByName(name.c_str()));
+}
+#endif
+
+
+/**
+ @brief Return number of known peers
+ 
+ This returns the number of remote devices that have been found by scanning.
+ 
+ @return - the number of remote devices found.
+ 
+ @note this is a static routine.
+ */
+int BLERemDev::getFoundCount()
+{
+    return(_peerCount);
+}
+
+/**
+ @brief Get the remote accessory pool high water mark
+ 
+ Remote accessories are held in a fixed pool of ACC_POOL_SIZE.  This gives the most that have been in use at once.
+ 
+ @return the pool high water mark
+ */
+int BLERemDev::getAccPoolHighWater()
+{
+    return(_accHighWater);
+}
+
+/**
+ @brief Set a route
+ 
+ This sets several points at once.  The steps are grouped by remote device.  Each remote device with a route
+ command characteristic is sent its steps in one write (a long write if they don't fit in one packet) and applies
+ them as a unit.  Steps for remote devices without one are sent as individual point commands.  These are not
+ applied as a unit and are fire-and-forget - their completion is not waited for or reported.
+ 
+ The route is checked before anything is sent.  It is rejected if any accessory is unknown or unavailable, any
+ position is invalid, any remote device would be given more than MAX_ROUTE_STEPS steps, or a previous route is
+ still being sent.
+ 
+ The writes are issued on the BLE thread.
+ 
+ @param steps - the route steps - accessory id and required position
+ @param count - number of steps
+ @param done - called once on the BLE thread when all the route writes have completed, with true if all were
+ accepted and all the individual point commands were issued
+ 
+ @return true if the route was accepted and sending started, false if rejected
+ 
+ @note this is a static routine.
+ */
+bool BLERemDev::setRoute(const RouteStep_t* steps, int count, mbed::Callback<void(bool)> done)
+{
+    RemAccessory* remAcc;
+    BLERemDev* remDev;
+    uint8_t* buf;
+    
+    if (core_util_atomic_exchange_bool(&_routeBusy, true))
+    {
+        return(false);  // one at a time
+    }
+    // check the whole route first, grouping the steps by remote device
+    // the route buffers are not touched by the BLE thread until the send is posted
+    for (int c = 0; c < _bleConCount; c++)
     {
-        // we've found it
-        return(_bleCon[i]._connect());
+        _bleCon[c]._routeBuf[0] = 0;  // step count
     }
-    else
+    for (int i = 0; i < count; i++)
+    {
+        remAcc = RemAccessory::findRemAccById(steps[i].id);
+        remDev = (remAcc == nullptr)?nullptr:remAcc->getConnection();
+        if ((remDev == nullptr) ||
+            (remAcc->getState() == P_UNAVAIL) ||
+            ((steps[i].pos != POINT_NORMAL) && (steps[i].pos != POINT_REVERSE)) ||
+            (remDev->_routeBuf[0] >= MAX_ROUTE_STEPS))
+        {
+#if DEBUG
+            Serial.print("Route rejected at step ");
+            Serial.println(i);
+#endif
+            core_util_atomic_store_bool(&_routeBusy, false);
+            return(false);
+        }
+        buf = remDev->_routeBuf + ROUTE_SIZE(remDev->_routeBuf[0]);
+        buf[0] = remAcc->cmdValueHandle() & 0xff;
+        buf[1] = remAcc->cmdValueHandle() >> 8;
+        buf[2] = (uint8_t)steps[i].pos;
+        remDev->_routeBuf[0]++;
+    }
+    
+    // send from the BLE thread so the route state is only ever touched there
+    _routeDoneCB = done;
+    if (BLEcore::instance().getEventQueue()->call(mbed::callback(&BLERemDev::_sendRoute)) == 0)
     {
+        core_util_atomic_store_bool(&_routeBusy, false);  // event queue full
         return(false);
     }
+    return(true);
+}
+
+// send each remote device its route steps - BLE thread
+void BLERemDev::_sendRoute()
+{
+    BLERemDev* remDev;
+    RemAccessory* remAcc;
+    const uint8_t* step;
+    GattAttribute::Handle_t h;
+    ble_error_t bleErr;
+    
+    _routeOK = true;
+    _routeOutstanding = 1;  // held until all the writes are issued
+    for (int c = 0; c < _bleConCount; c++)
+    {
+        remDev = &_bleCon[c];
+        if (remDev->_routeBuf[0] == 0)
+        {
+            continue;
+        }
+        if (remDev->_connHandle == NO_CONN_HANDLE)
+        {
+            _routeOK = false;  // disconnected since the route was checked
+        }
+        else if (remDev->_routeH != GattAttribute::INVALID_HANDLE)
+        {
+            // if too long for one packet the stack does a long write
+            bleErr = remDev->_gattClient.write(GattClient::GATT_OP_WRITE_REQ,
+                                               remDev->_connHandle,
+                                               remDev->_routeH,
+                                               ROUTE_SIZE(remDev->_routeBuf[0]),
+                                               remDev->_routeBuf);
+            if (bleErr == BLE_ERROR_NONE)
+            {
+                remDev->_routePending = true;
+                _routeOutstanding++;
+            }
+            else
+            {
+#if DEBUG
+                Serial.print("Route write error:");
+                Serial.println(bleErr);
+#endif
+                _routeOK = false;
+            }
+        }
+        else
+        {
+            // no route command - one point command per step, not waited for
+            for (uint8_t i = 0; i < remDev->_routeBuf[0]; i++)
+            {
+                step = &remDev->_routeBuf[ROUTE_SIZE(i)];
+                h = step[0] | (step[1] << 8);
+                remAcc = remDev->_firstRemAcc;
+                while ((remAcc != nullptr) && (remAcc->cmdValueHandle() != h))
+                {
+                    remAcc = remDev->_nextRemAcc(remAcc);
+                }
+                _routeOK = (remAcc != nullptr) && remAcc->setPoint((PointPos_t)step[2]) && _routeOK;
+            }
+        }
+    }
+    _routeWriteDone(true);  // release the hold
 }
 
+// a route write has completed - BLE thread
+void BLERemDev::_routeWriteDone(bool ok)
+{
+    _routeOK = _routeOK && ok;
+    if (--_routeOutstanding == 0)
+    {
+        mbed::Callback<void(bool)> done = _routeDoneCB;
+        core_util_atomic_store_bool(&_routeBusy, false);  // a new route may be set from the callback
+        if (done)
+        {
+            done(_routeOK);
+        }
+    }
+}
 
 /**
- @brief Return number of known connections
+ @brief Disconnnect all connected devices
  
- This returns the number of known client connections that have found by scanning.
- 
- @return - the number of client connections.
+ This disconnects from every connected remote device.
  
  @note this is a static routine.
  */
-int BLERemDev::getFoundCount()
+void BLERemDev::disconnect()
 {
-    return(_bleConCount);
+    for (int i = 0; i < _bleConCount; i++)
+    {
+        if (_bleCon[i]._connHandle != NO_CONN_HANDLE)
+        {
+            _bleCon[i]._disconn();
+        }
+    }
 }
 
 /**
- @brief Disconnnect the currently connected device
+ @brief Disconnect a remote device identified by index
+ 
+ This disconnects the remote device found by scanning at the given index if it is connected.
  
- This disconnects from the currently connected device.
+ @param index - peer index number
+ 
+ @return true if the disconnect was initiated
  
  @note this is a static routine.
  */
-void BLERemDev::disconnect()
+bool BLERemDev::disconnectByIndex(int index)
 {
-    if (_activeRemDev != nullptr)
+    BLERemDev* remDev;
+    if ((index < _peerCount) && (index >= 0))
     {
-        _activeRemDev->_disconn();
+        remDev = _peerTab[_peerOrder[index]].remDev;
+        if ((remDev != nullptr) && (remDev->_connHandle != NO_CONN_HANDLE))
+        {
+            remDev->_disconn();
+            return(remDev->_clientConState == CS_DISCONNECTING);
+        }
     }
+    return(false);
 }
 
 /**
@@ -227,25 +520,63 @@ void BLERemDev::disconnect()
  
  Exposes the local name of the peer for the connection
  
- @return the local name as a string.
+ @return the local name as a null terminated string.
  */
-String& BLERemDev::getLocalName()
+const char* BLERemDev::getLocalName()
 {
     return(_localName);
 }
 
+#if DAWS_STRING_API
+/**
+ @brief Get the device's local name as a String
+ 
+ As getLocalName, for sketches written for the String interface.  A copy is returned so
+ String& can no longer be taken - use String or getLocalName.
+ 
+ @return the local name as a String.
+ */
+String BLERemDev::getLocalNameString()
+{
+    return(String(_localName));
+}
+#endif
+
 /**
  @brief Get the device's local name by index
  
- Exposes the local name of the peer for the connection at the given index.
+ Exposes the local name of the peer found by scanning at the given index.
+ 
+ @param i - peer index number
+ @return the local name as a null terminated string or nullptr if the index is out of range.
+ */
+const char* BLERemDev::getLocalNameByIndex(int i)
+{
+    if ((i < _peerCount) && (i >= 0))
+    {
+        return(_peerTab[_peerOrder[i]].localName);
+    }
+    else
+    {
+        return(nullptr);
+    }
+}
+
+#if DAWS_STRING_API
+/**
+ @brief Get the device's local name by index as a String
+ 
+ As getLocalNameByIndex, for sketches written for the String interface.
  
- @param i - connection index number
- @return the local name as a string.
+ @param i - peer index number
+ @return the local name as a String - empty if the index is out of range.
  */
-String& BLERemDev::getLocalNameByIndex(int i)
+String BLERemDev::getLocalNameStringByIndex(int i)
 {
-    return(_bleCon[i]._localName);
+    const char* name = getLocalNameByIndex(i);
+    return(String((name == nullptr)?"":name));
 }
+#endif
 
 /**
  @brief Initiate connection to BLE server
@@ -272,8 +603,8 @@ bool BLERemDev::_connect()
         (_clientConState == CS_ERR))
     {
         // initiate the connection - the connection process runs asynchronously
-        // a callback is set up to monitor for completion.
-        bleErr = BLE::Instance().gap().connect
+        // the core passes completion straight back to this object as owner.
+        bleErr = BLEcore::instance().connect
         (
          _peerAddType,
          //peer_address_type_t::RANDOM,
@@ -287,12 +618,13 @@ bool BLERemDev::_connect()
                             )
          .setConnectionParameters(
                                   phy_t::LE_1M,
-                                  conn_interval_t(millisecond_t(100)),
-                                  conn_interval_t(millisecond_t(200)),
-                                  slave_latency_t(0),
-                                  supervision_timeout_t(millisecond_t(1000))
+                                  conn_interval_t(_connParams[_reqProfile].minInterval),
+                                  conn_interval_t(_connParams[_reqProfile].maxInterval),
+                                  slave_latency_t(_connParams[_reqProfile].latency),
+                                  supervision_timeout_t(_connParams[_reqProfile].timeout)
                                   )
-         .setOwnAddressType(own_address_type_t::RANDOM)
+         .setOwnAddressType(own_address_type_t::RANDOM),
+         this
          );
         
         if (bleErr != BLE_ERROR_NONE)
@@ -306,17 +638,9 @@ bool BLERemDev::_connect()
         }
         else
         {
-            // connection initiated - set callback to pick up result
-            BLEcore::instance().setConnectionCompleteCallback
-            (
-             mbed::callback(
-                            this, &BLERemDev::_initServiceDiscovery));
-            // and disconnection when it occurs
-            BLEcore::instance().setDisconnectionCompleteCallback
-            (
-             mbed::callback(
-                            this, &BLERemDev::_serverDisconnected));
-            _activeRemDev = this;
+            // connection initiated - GATT client results are routed back here
+            // by connection handle once known
+            _setCallbacks();
 #if DEBUG
             Serial.println("Connect initiated");
 #endif
@@ -350,7 +674,10 @@ void BLERemDev::_disconn()
     (
      _connHandle,  ble::local_disconnection_reason_t::USER_TERMINATION
      );
-    _activeRemDev = nullptr;
+    if (_activeRemDev == this)
+    {
+        _activeRemDev = nullptr;
+    }
     if (bleErr == BLE_ERROR_NONE)
     {
         _clientConState = CS_DISCONNECTING; // disconnect in progress
@@ -371,18 +698,28 @@ void BLERemDev::_disconn()
  If the detected device is advertising our service and has not been previously reported it is added to the connection
  array.
  
+ The peer table is checked first so repeat reports from a known peer are dropped without parsing.
+ Otherwise the report is parsed in place.  The local name and the service list are held as pointers into the advertising
+ payload and nothing is copied (or allocated) until the service list has been matched against the accessory service.
+ Reports from other devices (phones, beacons etc.) are rejected without looking at the name.
+ 
  @note This is a static function
  */
 
 void BLERemDev::_processScanReport(const ble::AdvertisingReportEvent& event)
 {
-    //ble_error_t bleErr;
     ble::AdvertisingDataParser advParser(event.getPayload());
     
-    UUID::LongUUIDBytes_t foundUUID128;  // 128 bit representation of UUID
-    UUID foundUUID = UUID();             // empty UUID
-    String localName;
-    int i;
+    const uint8_t* namep = nullptr;      // local name as found in the payload
+    size_t nameLen = 0;                  // and its length
+    bool servFound = false;              // true if the accessory service is advertised
+    unsigned int slot;                   // peer table slot
+    
+    slot = _findPeer(event.getPeerAddress(), event.getPeerAddressType());
+    if (_peerTab[slot].inUse || (_peerCount >= MAX_PEER_COUNT))
+    {
+        return;  // already known or no room for it
+    }
     
     while (advParser.hasNext())
     {
@@ -392,20 +729,20 @@ void BLERemDev::_processScanReport(const ble::AdvertisingReportEvent& event)
         switch (field.type.value())
         {
             case ble::adv_data_type_t::COMPLETE_LOCAL_NAME:
-                for (size_t x = 0; x < len; x++)
-                {
-                    localName.concat((char)field.value[x]);
-                }
+                // just note where it is - it's only needed if this is one of ours
+                namep = field.value.data();
+                nameLen = len;
                 break;
                 
             case ble::adv_data_type_t::INCOMPLETE_LIST_128BIT_SERVICE_IDS:
             case ble::adv_data_type_t::COMPLETE_LIST_128BIT_SERVICE_IDS:
-                
-                for (size_t x = 0; x < len; x++)
+                // the list may hold more than one UUID - check each in turn
+                // UUIDs are held LSB first, the same as the UUID base bytes
+                for (size_t x = 0; (x + UUID::LENGTH_OF_LONG_UUID <= len) && !servFound;
+                     x += UUID::LENGTH_OF_LONG_UUID)
                 {
-                    foundUUID128[x & 0xf] = field.value[x];
+                    servFound = BLEcore::isServUUID(field.value.data() + x);
                 }
-                foundUUID = UUID(foundUUID128, UUID::LSB);
                 break;
             default:
                 // not interested in this field type
@@ -414,54 +751,114 @@ void BLERemDev::_processScanReport(const ble::AdvertisingReportEvent& event)
     }
     // all fields parsed
 
-    if (foundUUID == BLEcore::getServUUID())
+    if (!servFound)
+    {
+        return;  // not a DAWS accessory controller
+    }
+    
+    // it's one of ours and not seen before
+    // set up the peer record with local name, address and address type as determined from scan
+    BLEPeer_t& peer = _peerTab[slot];
+    if (nameLen >= MAX_NAME_SIZE)
+    {
+        nameLen = MAX_NAME_SIZE - 1;  // truncate if too long (it shouldn't be)
+    }
+    if (nameLen > 0)
     {
+        memcpy(peer.localName, namep, nameLen);
+    }
+    peer.localName[nameLen] = '\0';
+    peer.peerAdd = event.getPeerAddress();
+    peer.peerAddType = event.getPeerAddressType();
+    peer.remDev = nullptr;
+    peer.inUse = true;
+    _peerOrder[_peerCount] = slot;
+    BLEcore::instance().queueReport(BLE_PEER_FOUND, _peerCount);
 #if DEBUG
-        const ble::address_t& peerAddress = event.getPeerAddress();
-        Serial.print("Accessory service peer found ");
-        Serial.println(localName);
-        Serial.print('\t');
-        BLEcore::printUUID(foundUUID);
-        Serial.print('\t');
-        for (int i = 0; i < 6; i++)
-        {
-            if (peerAddress[i] < 16)
-            {
-                Serial.print('0');
-            }
-            Serial.print(peerAddress[i], HEX);
-            if (i < 5)
-            {
-                Serial.print(':');
-            }
-            else
-            {
-                Serial.println();
-            }
+    const ble::address_t& peerAddress = event.getPeerAddress();
+    Serial.print("Accessory service peer found ");
+    Serial.println(peer.localName);
+    Serial.print('\t');
+    for (int i = 0; i < 6; i++)
+    {
+        if (peerAddress[i] < 16)
+        {
+            Serial.print('0');
         }
-#endif
-        // see if already known - if not set up the next free connection record
-        // with local name, address and address type as determined from scan
-        i = 0;
-        while ((i < _bleConCount) && (localName != _bleCon[i]._localName))
+        Serial.print(peerAddress[i], HEX);
+        if (i < 5)
         {
-            i++;
+            Serial.print(':');
         }
-        if ((localName != _bleCon[i]._localName) && _bleConCount < MAX_REMOTE_CON)
+        else
         {
-            // it's one not seen before and we have room for it
-            _bleCon[i]._localName = localName;
-            _bleCon[i]._peerAdd = event.getPeerAddress();
-            _bleCon[i]._peerAddType = event.getPeerAddressType();
-            _bleCon[i]._clientConState = CS_CONNECTABLE;
-            _bleConCount++;  // increment number of known connections
-            BLEcore::instance().queueReport(BLE_PEER_FOUND, i);
-#if DEBUG
-            Serial.print("New connection added ");
-            Serial.println(i);
-#endif
+            Serial.println();
         }
     }
+    Serial.print("New peer added ");
+    Serial.println(_peerCount);
+#endif
+    _peerCount++;  // increment number of known peers
+}
+
+/**
+ @brief Find a peer in the peer table
+ 
+ The peer table is open addressed.  The peer address and address type are hashed (FNV-1a) to give the
+ starting slot and slots are then probed in turn.  The table is never full so the search always terminates.
+ 
+ @param add - peer address
+ @param addType - peer address type
+ 
+ @return the slot holding the peer if known, otherwise the free slot where it should be added
+ 
+ @note This is a static function
+ */
+unsigned int BLERemDev::_findPeer(const ble::address_t& add,
+                                  const ble::peer_address_type_t addType)
+{
+    uint32_t h = 2166136261UL;  // FNV offset basis
+    unsigned int slot;
+    
+    for (size_t x = 0; x < add.size(); x++)
+    {
+        h = (h ^ add[x]) * 16777619UL;  // FNV prime
+    }
+    h = (h ^ addType.value()) * 16777619UL;
+    
+    slot = h & (PEER_TABLE_SIZE - 1);
+    while (_peerTab[slot].inUse &&
+           ((_peerTab[slot].peerAdd != add) || (_peerTab[slot].peerAddType != addType)))
+    {
+        slot = (slot + 1) & (PEER_TABLE_SIZE - 1);
+    }
+    return(slot);
+}
+
+/**
+ @brief Assign a connection object to a peer
+ 
+ Connection objects are only needed for peers that are actually connected.  The first time a peer is connected
+ the next free connection object is set up from the peer record.
+ 
+ @param peer - the peer record
+ 
+ @return pointer to the peer's connection object or nullptr if none is free
+ 
+ @note This is a static function
+ */
+BLERemDev* BLERemDev::_assignRemDev(BLEPeer_t& peer)
+{
+    if ((peer.remDev == nullptr) && (_bleConCount < MAX_REMOTE_CON))
+    {
+        BLERemDev& remDev = _bleCon[_bleConCount++];
+        strcpy(remDev._localName, peer.localName);  // same size
+        remDev._peerAdd = peer.peerAdd;
+        remDev._peerAddType = peer.peerAddType;
+        remDev._clientConState = CS_CONNECTABLE;
+        peer.remDev = &remDev;
+    }
+    return(peer.remDev);
 }
 //******************
 // this is the call back for when
@@ -474,47 +871,22 @@ void BLERemDev::_initServiceDiscovery(const ble::connection_handle_t ch)
     switch (_clientConState)
     {
         case CS_CONNECTABLE:
+            // first connection since power on - try the handle cache
+            _connHandle = ch;
+            if (_restoreFromCache())
+            {
+                // wait for the check reads to complete
+                _clientConState = CS_CACHE_CHECK;
+                _issueOps();
+                break;
+            }
+            // no usable cache entry so do discovery
+            // fall through
         case CS_ERR:
             // service discovery has not been performed for this connection yet
             // or needs to be redone
             _connHandle = ch;
-            //_nextDA = 0;  // first discovered accessory is next to be allocated
-#if DEBUG
-            Serial.println("Starting service discovery");
-#endif
-            
-            // set callbacks to point at this connection
-            // we will only have one connection discovering at a time
-            //
-            // the first stage is to discover services and their characteristics
-            // this follows the tree structure i.e the callbacks return a service and
-            // its characteristics before moving to the next service.
-            _gattClient.onServiceDiscoveryTermination
-            (
-             ServiceDiscovery::TerminationCallback_t(
-                                                     this,
-                                                     &BLERemDev::_discoveryTermination
-                                                     ));
-            
-
-
-            // start service discovery - callbacks are set to monitor progress
-            _gattClient.launchServiceDiscovery
-            (
-             ch,
-             ServiceDiscovery::ServiceCallback_t(
-                                                 this,
-                                                 &BLERemDev::_serviceDiscovered
-                                                 ),
-             ServiceDiscovery::CharacteristicCallback_t(
-                                                        this,
-                                                        &BLERemDev::_characDiscovered
-                                                        ),
-             UUID(BLE_UUID_UNKNOWN),  // matching service UUID
-             UUID(BLE_UUID_UNKNOWN)     // matching characteristic UUID
-             );
-            
-            _clientConState = CS_CON_FIRST; // Looking for first real service
+            _startDiscovery();
             break;
             
         case CS_DISCON:
@@ -530,16 +902,8 @@ void BLERemDev::_initServiceDiscovery(const ble::connection_handle_t ch)
             }
 #endif
             _connHandle = ch;
-            _remAcc = _firstRemAcc;
-            _clientConState = CS_RECON_INIT; // set reconnect initialisation
-            
-            if(!_remAcc->initCharacteristics(_clientConState))
-            {
-                // if CCCD write fails do the next one
-                _doNextDA();
-            }
-            
-            // otherwise wait for write completion callback
+            _setRemAccConn(ch);  // the accessories need the new handle
+            _startReconInit();
             break;
             
         default:
@@ -550,74 +914,409 @@ void BLERemDev::_initServiceDiscovery(const ble::connection_handle_t ch)
             break;
     }
 }
-// server disconnect callback - disconnect may have been issued locally,
-// remotely or as result of
-// a communications failure
-void BLERemDev::_serverDisconnected(const ble::DisconnectionCompleteEvent& event)
+
+// start service discovery on the current connection
+void BLERemDev::_startDiscovery()
 {
-    if (event.getConnectionHandle() == _connHandle)
-    {
-        
+    //_nextDA = 0;  // first discovered accessory is next to be allocated
 #if DEBUG
-        Serial.print(_localName);
-        Serial.print(" - Server Disconnected. Reason 0x");
-        Serial.println(event.getReason().value(), HEX);
+    Serial.println("Starting service discovery");
 #endif
-        _clientConState = CS_DISCON;
-        // clear callbacks
-        BLEcore::instance().setConnectionCompleteCallback(nullptr);
-        BLEcore::instance().setDisconnectionCompleteCallback(nullptr);
-        _queueRemAccReps(RA_DISCONNECTED, event.getReason().value());
+    
+    // the first stage is to discover services and their characteristics
+    // this follows the tree structure i.e the callbacks return a service and
+    // its characteristics before moving to the next service.
+    // discovery termination is routed back here by connection handle
+    // so other connections may be discovering at the same time
+    
+    _discardRemAccs();  // anything left from a failed attempt
+    _aggStateH = _aggCCCDH = GattAttribute::INVALID_HANDLE;
+    _routeH = GattAttribute::INVALID_HANDLE;
+    _clientConState = CS_CON_FIRST; // Looking for first real service
+#if TARGETED_DISCOVERY
+    // targeted discovery is in passes - the GAP service for the device name only
+    // then the accessory services and finally the controller service.
+    // Characteristics are only discovered within the matching services' handle ranges.
+    _discPass = DP_GAP;
+    if (_launchDiscovery(UUID(BLE_UUID_GAP),
+                         UUID(BLE_UUID_GAP_CHARACTERISTIC_DEVICE_NAME)) != BLE_ERROR_NONE)
+    {
+        _clientConState = CS_ERR;
     }
-#if DEBUG
-    else
+#else
+    _discPass = DP_NONE;
+    if (_launchDiscovery(UUID(BLE_UUID_UNKNOWN),
+                         UUID(BLE_UUID_UNKNOWN)) != BLE_ERROR_NONE)
     {
-        Serial.println("Disconnect call back - wrong handle");
+        _clientConState = CS_ERR;
     }
 #endif
 }
 
-
-
-
-//************************************************
-//
-// Service discovered callback
-//
-//************************************************
-void BLERemDev::_serviceDiscovered(const DiscoveredService *service)
+// start service discovery - callbacks are set to monitor progress
+ble_error_t BLERemDev::_launchDiscovery(const UUID& servUUID, const UUID& characUUID)
 {
-    // making a service shallow copy using the = operator is disabled in 6.9 and later
-    // so we need to explicitly retain any service info needed later
-    // see if the UUID is for a service we are interested in
-    _serviceUUID = service->getUUID();
-    if (_serviceUUID == BLEcore::getServUUID()) // is this a point service
-    {
-        // save the discovered service UUID and associate with this connection
-        // remote accessories are created on the heap but never deleted so
-        // heap fragmentation shouldn't be a problem
-        _remAcc = new RemAccessory(_connHandle, _serviceUUID);
+    ble_error_t bleErr;
+    bleErr = _gattClient.launchServiceDiscovery
+    (
+     _connHandle,
+     ServiceDiscovery::ServiceCallback_t(
+                                         this,
+                                         &BLERemDev::_serviceDiscovered
+                                         ),
+     ServiceDiscovery::CharacteristicCallback_t(
+                                                this,
+                                                &BLERemDev::_characDiscovered
+                                                ),
+     servUUID,  // matching service UUID
+     characUUID     // matching characteristic UUID
+     );
 #if DEBUG
-    Serial.print("Found Accessory Service:\n\t");
-        BLEcore::printUUID(_serviceUUID);
-#endif
-
-        if (_clientConState == CS_CON_FIRST)  // This is the first service of interest
-        {
-            //_nextDA = 0;  // static next points to the next free record
-            _countDA = 1;  //
-            _firstRemAcc = _remAcc; // save the first one
-            _clientConState = CS_CON_DISC;
-        }
-        else
-        {
-            _countDA++;
-        }
+    if (bleErr != BLE_ERROR_NONE)
+    {
+        Serial.print("Launch discovery error:");
+        Serial.println(bleErr);
     }
+#endif
+    return(bleErr);
 }
 
-//************************************************
-//
+// next pass of targeted discovery - accessory services or the controller service
+// and all their characteristics
+// deferred from the previous pass termination callback as the stack has not finished with
+// the previous discovery until the callback returns
+void BLERemDev::_discoverNextPass()
+{
+    if ((_clientConState != CS_CON_FIRST) && (_clientConState != CS_CON_DISC))
+    {
+        return;  // disconnected in the meantime
+    }
+    if (_launchDiscovery((_discPass == DP_CTL)?BLEcore::getCtlServUUID():BLEcore::getServUUID(),
+                         UUID(BLE_UUID_UNKNOWN)) != BLE_ERROR_NONE)
+    {
+        _clientConState = CS_ERR;
+    }
+}
+
+// start re-initialisation of known accessories - CCCD writes and state reads
+void BLERemDev::_startReconInit()
+{
+    _clientConState = CS_RECON_INIT; // set reconnect initialisation
+    _opHead = _opCount = 0;
+    _opInFlight = false;
+    _retryCount = 0;
+    if (_useAgg)
+    {
+        // all the states in one CCCD write and one read rather than one per accessory
+        _queueOp(OP_WRITE_AGG_CCCD, nullptr, GattAttribute::INVALID_HANDLE);
+        _queueOp(OP_READ_AGG, nullptr, _aggStateH);
+    }
+    _remAcc = _firstRemAcc;
+    _fillStep = 0;
+    _fillOps();  // CCCD writes and state reads
+    _issueOps();
+}
+
+// server disconnect callback - disconnect may have been issued locally,
+// remotely or as result of
+// a communications failure
+// only called for this connection's handle
+void BLERemDev::_serverDisconnected(const ble::DisconnectionCompleteEvent& event)
+{
+#if DEBUG
+    Serial.print(_localName);
+    Serial.print(" - Server Disconnected. Reason 0x");
+    Serial.println(event.getReason().value(), HEX);
+#endif
+    _opCount = 0;  // abandon any initialisation in progress
+    _opInFlight = false;
+    if (_clientConState == CS_CACHE_CHECK)
+    {
+        // the restored handles were never confirmed - don't reconnect with them
+        // the cache is tried again on the next connection
+        _discardRemAccs();
+        _clientConState = CS_CONNECTABLE;
+    }
+    else
+    {
+        _clientConState = CS_DISCON;
+    }
+    if (_routePending)
+    {
+        _routePending = false;
+        _routeWriteDone(false);
+    }
+    _queueRemAccReps(RA_DISCONNECTED, event.getReason().value());
+    _setRemAccConn(NO_CONN_HANDLE);
+    _connHandle = NO_CONN_HANDLE;
+    if (_activeRemDev == this)
+    {
+        _activeRemDev = nullptr;
+    }
+}
+
+/**
+ @brief Connection complete
+ 
+ The BLE core calls this when a connect initiated by this object completes.  If successful, service discovery
+ (or re-initialisation) starts.  On failure the state is unchanged so the connect may be retried.
+ 
+ @param event - connection complete event
+ */
+void BLERemDev::onConnected(const ble::ConnectionCompleteEvent& event)
+{
+    if (event.getStatus() == BLE_ERROR_NONE)
+    {
+        _activeRemDev = this;
+        _connProfile = _reqProfile;  // connected with the requested profile
+        _connInterval = event.getConnectionInterval().value();
+        _initServiceDiscovery(event.getConnectionHandle());
+    }
+}
+
+/**
+ @brief Connection parameters updated
+ 
+ The BLE core calls this when a connection parameter update on this object's connection completes.  If successful the
+ requested profile is now in use.  Otherwise the previous profile remains in use.
+ 
+ @param event - connection parameters update complete event
+ */
+void BLERemDev::onParamsUpdated(const ble::ConnectionParametersUpdateCompleteEvent& event)
+{
+    if (event.getStatus() == BLE_ERROR_NONE)
+    {
+        _connProfile = _reqProfile;
+        _connInterval = event.getConnectionInterval().value();
+    }
+    else
+    {
+        _reqProfile = _connProfile;
+    }
+#if DEBUG
+    Serial.print(_localName);
+    Serial.print(" - profile ");
+    Serial.print(_connProfile);
+    Serial.print(" interval ");
+    Serial.println(_connInterval);
+#endif
+}
+
+/**
+ @brief Select the connection latency profile
+ 
+ If connected, this requests a connection parameter update to the given profile.  The profile is in use once the
+ update completes.  If not connected, the profile is used for the next connection.
+ 
+ @param profile - the profile required
+ 
+ @return true if the update was requested (or will be used at the next connect)
+ */
+bool BLERemDev::setConnProfile(ConnProfile_t profile)
+{
+    ble_error_t bleErr;
+    using namespace ble;
+    
+    if (profile >= CP_MAX)
+    {
+        return(false);
+    }
+    if (_connHandle == NO_CONN_HANDLE)
+    {
+        _connProfile = _reqProfile = profile;
+        return(true);
+    }
+    bleErr = BLE::Instance().gap().updateConnectionParameters
+    (
+     _connHandle,
+     conn_interval_t(_connParams[profile].minInterval),
+     conn_interval_t(_connParams[profile].maxInterval),
+     slave_latency_t(_connParams[profile].latency),
+     supervision_timeout_t(_connParams[profile].timeout)
+     );
+#if DEBUG
+    if (bleErr != BLE_ERROR_NONE)
+    {
+        Serial.print("Connection parameter update error:");
+        Serial.println(bleErr);
+    }
+#endif
+    if (bleErr == BLE_ERROR_NONE)
+    {
+        _reqProfile = profile;  // in use when the update completes
+    }
+    return(bleErr == BLE_ERROR_NONE);
+}
+
+/**
+ @brief Expose the connection latency profile
+ 
+ @return the profile in use (or to be used at the next connect)
+ */
+ConnProfile_t BLERemDev::getConnProfile()
+{
+    return(_connProfile);
+}
+
+/**
+ @brief Expose the connection interval
+ 
+ This is the interval actually negotiated with the peripheral which may be anywhere in the profile's range.
+ 
+ @return the connection interval in microseconds - 0 if never connected
+ */
+uint32_t BLERemDev::getConnIntervalUs()
+{
+    return((uint32_t)_connInterval * 1250);
+}
+
+/**
+ @brief Disconnection complete
+ 
+ The BLE core calls this when this object's connection closes.
+ 
+ @param event - disconnection complete event
+ */
+void BLERemDev::onDisconnected(const ble::DisconnectionCompleteEvent& event)
+{
+    _serverDisconnected(event);
+}
+
+/**
+ @brief Route GATT client callbacks to connections
+ 
+ The GATT client holds a single callback (or callback chain) for discovery termination,
+ read and write events.  These are set once, here, to static routines which pass each event to the connection
+ that owns the connection handle.  Connections no longer have to overwrite each other's callbacks so several
+ may be discovering and running at once.
+ 
+ @note This is a static function
+ */
+void BLERemDev::_setCallbacks()
+{
+    if (_conCBset)
+    {
+        return;
+    }
+    _conCBset = true;
+    
+    ble::GattClient& gattClient = BLE::Instance().gattClient();
+    gattClient.onServiceDiscoveryTermination(ServiceDiscovery::TerminationCallback_t(_onDiscoveryTermination));
+    gattClient.onDataRead(ble::ReadCallback_t(_onDataRead));
+    gattClient.onDataWritten(ble::WriteCallback_t(_onDataWritten));
+    gattClient.onHVX().add(GattClient::HVXCallback_t(_onHVX));
+}
+
+/**
+ @brief Find the connection for a connection handle
+ 
+ @param ch - connection handle
+ 
+ @return the connection object with that handle or nullptr if none (e.g. a peripheral role connection)
+ 
+ @note This is a static function
+ */
+BLERemDev* BLERemDev::_findByHandle(const ble::connection_handle_t ch)
+{
+    for (int i = 0; i < _bleConCount; i++)
+    {
+        if (_bleCon[i]._connHandle == ch)
+        {
+            return(&_bleCon[i]);
+        }
+    }
+    return(nullptr);
+}
+
+// service discovery terminated - route by connection handle
+void BLERemDev::_onDiscoveryTermination(const ble::connection_handle_t ch)
+{
+    BLERemDev* remDev = _findByHandle(ch);
+    if (remDev != nullptr)
+    {
+        remDev->_discoveryTermination(ch);
+    }
+}
+
+// data read - route by connection handle
+void BLERemDev::_onDataRead(const GattReadCallbackParams* cbp)
+{
+    BLERemDev* remDev = _findByHandle(cbp->connHandle);
+    if (remDev != nullptr)
+    {
+        remDev->_dataRead(cbp);
+    }
+}
+
+// data written - route by connection handle
+void BLERemDev::_onDataWritten(const GattWriteCallbackParams* cbp)
+{
+    BLERemDev* remDev = _findByHandle(cbp->connHandle);
+    if (remDev != nullptr)
+    {
+        remDev->_dataWritten(cbp);
+    }
+}
+
+// notification - route aggregated state by connection handle
+// accessory notifications are dispatched by the accessories
+void BLERemDev::_onHVX(const GattHVXCallbackParams* cbp)
+{
+    BLERemDev* remDev = _findByHandle(cbp->connHandle);
+    if ((remDev != nullptr) &&
+        (cbp->handle == remDev->_aggStateH))
+    {
+        remDev->_aggStateUpdate(cbp->data, cbp->len, true);
+    }
+}
+
+
+
+
+//************************************************
+//
+// Service discovered callback
+//
+//************************************************
+void BLERemDev::_serviceDiscovered(const DiscoveredService *service)
+{
+    // making a service shallow copy using the = operator is disabled in 6.9 and later
+    // so we need to explicitly retain any service info needed later
+    // see if the UUID is for a service we are interested in
+    _serviceUUID = service->getUUID();
+    if (BLEcore::isServUUID(_serviceUUID)) // is this a point service
+    {
+        // save the discovered service UUID and associate with this connection
+        // remote accessories come from the pool - the id isn't known yet
+        _remAcc = nullptr;
+        if (_countDA < MAX_DISCOVERED_ACCESSORY)
+        {
+            _remAcc = _allocRemAcc(nullptr);
+        }
+        if (_remAcc == nullptr)
+        {
+#if DEBUG
+            Serial.println("No room for accessory");
+#endif
+            return;
+        }
+        _remAcc->initSvr(_connHandle);
+        _stateLastH[_countDA] = GattAttribute::INVALID_HANDLE;  // not found yet
+        _addRemAcc(_remAcc);
+#if DEBUG
+    Serial.print("Found Accessory Service:\n\t");
+        BLEcore::printUUID(_serviceUUID);
+#endif
+
+        if (_clientConState == CS_CON_FIRST)  // This is the first service of interest
+        {
+            _clientConState = CS_CON_DISC;
+        }
+    }
+}
+
+//************************************************
+//
 // Characteristic discovered callback
 //
 //************************************************
@@ -643,11 +1342,36 @@ void BLERemDev::_characDiscovered(const DiscoveredCharacteristic *characteristic
             _devNameCharac = *characteristic;
         }
     }
-    else if (_serviceUUID == BLEcore::getServUUID())
+    else if (BLEcore::isServUUID(_serviceUUID))
     {
         // this is an accessory service
         // the characteristic will be saved if it's one of interest
-        _remAcc->saveCharacteristic(characteristic);
+        // the state characteristic's last handle is kept for descriptor discovery
+        if ((_remAcc != nullptr) &&
+            (_remAcc->saveCharacteristic(characteristic) == STATE_UUID))
+        {
+            _stateLastH[_countDA - 1] = characteristic->getLastHandle();
+        }
+    }
+    else if (BLEcore::isCtlServUUID(_serviceUUID))
+    {
+        // controller service
+        switch (BLEcore::matchUUID(characteristic->getUUID()))
+        {
+            case AGG_STATE_UUID:
+                // the controller's aggregated state
+                _aggStateDC = *characteristic;
+                _aggStateH = characteristic->getValueHandle();
+                break;
+                
+            case ROUTE_UUID:
+                // the controller's route command
+                _routeH = characteristic->getValueHandle();
+                break;
+                
+            default:
+                break;
+        }
     }
 }
 
@@ -665,46 +1389,55 @@ void BLERemDev::_characDiscovered(const DiscoveredCharacteristic *characteristic
 // for each service we need to read its id characteristic and the current state characteristic
 // if the characteristic has a CCCD, this has to be discovered and written
 // to initiate notifications.
+// all of these are queued up front and issued back to back by the GATT operation queue
 void BLERemDev::_discoveryTermination(const ble::connection_handle_t)
 {
-    ble_error_t bleErr;
-    // set up data read and write callbacks
-    _gattClient.onDataRead(
-                           ble::ReadCallback_t(
-                                               this,
-                                               &BLERemDev::_dataRead
-                                               ));
-    // data written callback
-    _gattClient.onDataWritten
-    (
-     ble::WriteCallback_t(this, &BLERemDev::_dataWritten));
-    
-    
-    // first to be read is the device name
-    bleErr = _devNameCharac.read();
-    if (bleErr == BLE_ERROR_NONE)
-    {
-        _clientConState = CS_CON_INIT;
-    }
-    else
+    if ((_discPass == DP_GAP) || (_discPass == DP_ACC))
     {
-        _clientConState = CS_ERR;
+        // pass of targeted discovery done - on to the next
+        // device name first, then the accessory services, then the controller service
+        // the controller service is always looked for as routes need it - AGG_STATE only
+        // decides whether its aggregated state is used
+        _discPass = (_discPass == DP_GAP)?DP_ACC:DP_CTL;
+        BLEcore::instance().getEventQueue()->call
+        (
+         mbed::callback(this, &BLERemDev::_discoverNextPass)
+         );
+        return;
     }
+    _discPass = DP_NONE;
 #if DEBUG
     Serial.println("Discovery terminated.");
     Serial.print(_countDA);
     Serial.println(" accessory service(s) found.");
-    
-    if (bleErr == BLE_ERROR_NONE)
+#endif
+    if (_firstRemAcc == nullptr)
     {
-        Serial.println("Reading initial values");
+        _clientConState = CS_ERR;  // nothing of interest found
+        return;
     }
-    else
+    _clientConState = CS_CON_INIT;
+    _opHead = _opCount = 0;
+    _opInFlight = false;
+    _retryCount = 0;
+    // first to be read is the device name
+    if (_devNameCharac.getValueHandle() != GattAttribute::INVALID_HANDLE)
     {
-        Serial.print("Start DevName read error:");
-        Serial.println(bleErr);
+        _queueOp(OP_READ_NAME, nullptr, _devNameCharac.getValueHandle());
     }
-#endif
+    // if the controller has an aggregated state all the states are read and subscribed to at once
+    _useAgg = AGG_STATE && (_aggStateH != GattAttribute::INVALID_HANDLE);
+    if (_useAgg)
+    {
+        // subscribed before the read as for the accessory states
+        _queueOp(OP_DISC_AGG_DESCRIPS, nullptr, GattAttribute::INVALID_HANDLE);
+        _queueOp(OP_WRITE_AGG_CCCD, nullptr, GattAttribute::INVALID_HANDLE);
+        _queueOp(OP_READ_AGG, nullptr, _aggStateH);
+    }
+    _remAcc = _firstRemAcc;
+    _fillStep = 0;
+    _fillOps();
+    _issueOps();
 }
 //************************************************
 //
@@ -717,11 +1450,10 @@ void BLERemDev::_discoveryTermination(const ble::connection_handle_t)
 // an application request.
 // the handle identifies the characteristic for which a value has been
 // read from the server.
-// state variables indicte why the read was initiated
+// the operation at the head of the queue shows why the read was initiated
 //
 void BLERemDev::_dataRead(const GattReadCallbackParams* cbp)
 {
-    ble_error_t bleErr;
 #if DEBUG
     if (cbp->status == BLE_ERROR_NONE)
     {
@@ -743,62 +1475,71 @@ void BLERemDev::_dataRead(const GattReadCallbackParams* cbp)
     }
 #endif
 
-    if (cbp->handle == _devNameCharac.getValueHandle())
+    if (!_opInFlight || (_opCount == 0) || (cbp->handle != _ops[_opHead].handle))
     {
-        // device name characteristic as requested at end of discovery
-        // ****** not saved yet - setting it correctly at server end
-        // seems problematic
-        // - we use the one as returned by the scan!
-        // now start reading accessories ids etc
-        _remAcc = _firstRemAcc; // back to the first one
-        //bleErr = _remAcc->readId();  // initiate the read for the first one
-        if(!_remAcc->initCharacteristics(_clientConState))
-        {
-
-#if DEBUG
-        //if (bleErr != BLE_ERROR_NONE)
-        {
-            Serial.print("Start DA read error(first):");
-            Serial.println(bleErr);
-        }
-#endif
-        }
+        return;  // not one of ours
     }
-    // else see if accessory related id. characteristic we're expecting
-    else if (cbp->handle == _remAcc->idValueHandle())
+    
+    GattOp_t& op = _ops[_opHead];
+    if (cbp->status == BLE_ERROR_NONE)
     {
-        _remAcc->setRemAccId(cbp->data, cbp->len);
-        bleErr = _remAcc->processDescrips
-        (
-         mbed::callback(this, &BLERemDev::_descripsDone)
-         );
-
-        if (bleErr != BLE_ERROR_NONE)
+        switch (op.type)
         {
-#if DEBUG
-            Serial.print("Start DA read state error:");
-            Serial.println(bleErr);
-#endif
+            case OP_READ_NAME:
+                // device name characteristic as requested at end of discovery
+                // ****** not saved yet - setting it correctly at server end
+                // seems problematic
+                // - we use the one as returned by the scan!
+                break;
+                
+            case OP_READ_ID:
+                op.remAcc->setRemAccId(cbp->data, cbp->len);
+                op.remAcc->queueReport(RA_DISCOVERED, 0);
+                break;
+                
+            case OP_READ_STATE:
+                // result of state read.  Use it to set the point state
+                op.remAcc->setState((PointState_t)*(cbp->data));
+                break;
+                
+            case OP_READ_AGG:
+                // all the states at once
+                _aggStateUpdate(cbp->data, cbp->len, false);
+                break;
+                
+            case OP_CHECK_ID:
+                // the id must still be at the cached handle
+                if ((cbp->len != strlen(op.remAcc->getRemAccId())) ||
+                    (memcmp(cbp->data, op.remAcc->getRemAccId(), cbp->len) != 0))
+                {
+                    _cacheValid = false;
+                }
+                break;
+                
+            case OP_CHECK_AGG:
+                // one byte per accessory service - catches services added or removed
+                if (cbp->len != _countDA)
+                {
+                    _cacheValid = false;
+                }
+                break;
+                
+            default:
+                break;
         }
-
-        _remAcc->queueReport(RA_DISCOVERED, 0);
     }
-    else if (cbp->handle == _remAcc->stateValueHandle())
-        // result of state read.  Use it to set the point state
+    else
     {
-        _remAcc->setState((PointState_t)*(cbp->data));
-        
-        
-        // now attempt the CCCD write so set interest in notifications
-        if(!_remAcc->doCCCDwrite())
-        {
 #if DEBUG
-            Serial.println("CCCD write fail");
+        Serial.print("Read error:");
+        Serial.println(cbp->status);
 #endif
-            _clientConState = CS_ERR;
+        if ((op.type == OP_CHECK_ID) || (op.type == OP_CHECK_AGG))
+        {
+            _cacheValid = false;  // can't confirm the cached handles
         }
     }
-    
+    _opDone();
 }
 
 
@@ -811,10 +1552,7 @@ void BLERemDev::_dataRead(const GattReadCallbackParams* cbp)
 //************************************************
 void BLERemDev::_dataWritten(const GattWriteCallbackParams* cbp)
 {
-    //ble_error_t bleErr;
-    //int i = 0;
-    //bool daFound = false;
-    Reporter* nextReporter = Reporter::getFirstReporter();
+    DiscoveredAccCli* dac;
 #if DEBUG
     Serial.print("Written - handles con:");
     Serial.print( cbp->connHandle);
@@ -825,22 +1563,24 @@ void BLERemDev::_dataWritten(const GattWriteCallbackParams* cbp)
     Serial.print(" error:");
     Serial.println(cbp->error_code);
 #endif
-    // pass data written event to all the accessories until one accepts it
-    
-    
-    while ((nextReporter != nullptr) &&
-           ((nextReporter->getType() != RA_REP) ||
-            (!(((RemAccessory*)nextReporter)->dataWritten(cbp)))))
+    if (_opInFlight && (_opCount > 0) &&
+        ((_ops[_opHead].type == OP_WRITE_CCCD) || (_ops[_opHead].type == OP_WRITE_AGG_CCCD)) &&
+        (cbp->handle == _ops[_opHead].handle))
     {
-        // not taken - look at next one
-        nextReporter = nextReporter->getNextReporter();
+        _opDone();  // CCCD write for initialisation complete
+        return;
     }
-    if (((_clientConState == CS_CON_INIT) || // initial connection init or
-         (_clientConState == CS_RECON_INIT)) && // re-connection init
-        (nextReporter == (Reporter*) _remAcc)) // and it's the one being dealt with
+    if (_routePending && (cbp->handle == _routeH))
     {
-        
-        _doNextDA();  // final action on this DA completed
+        _routePending = false;
+        _routeWriteDone(cbp->status == BLE_ERROR_NONE);
+        return;
+    }
+    // pass data written event to the accessory that owns the handle
+    dac = DiscoveredAccCli::findByHandle(cbp->connHandle, cbp->handle);
+    if (dac != nullptr)
+    {
+        dac->dataWritten(cbp);
     }
     // else do action for normal write complete - at the moment nothing
     // specific action may have been taken by the accessory already
@@ -848,83 +1588,665 @@ void BLERemDev::_dataWritten(const GattWriteCallbackParams* cbp)
 
 //************************************************
 //
-// move on to the next Discovered Accessory
-// and intiate first action on it
-// This relies on the reporter chaining to be serial - any found after the first will need processing
-// whereas any before it will not need processing
+// GATT operation queue
+//
+// Reads, descriptor discovery and CCCD writes for initialisation are queued
+// for all accessories up front and issued back to back.  Each is issued as
+// soon as the one before completes so the link is never left idle waiting
+// for a state machine step.  The stack only allows one GATT procedure per
+// connection at a time so if it reports busy the issue is retried shortly.
 //************************************************
-void BLERemDev::_doNextDA()
+
+// add an operation to the queue
+bool BLERemDev::_queueOp(GattOpType_t type, RemAccessory* remAcc, GattAttribute::Handle_t h)
+{
+    if (_opCount >= MAX_GATT_OPS)
+    {
+        return(false);
+    }
+    GattOp_t& op = _ops[(_opHead + _opCount) % MAX_GATT_OPS];
+    op.type = type;
+    op.remAcc = remAcc;
+    op.handle = h;
+    _opCount++;
+    return(true);
+}
+
+// the operations are queued grouped by type, each step for every accessory before the next step
+// the CCCD writes come before the state reads so notifications are enabled before the state is read -
+// a change after the read is then always notified and the client never keeps a stale state
+const GattOpType_t BLERemDev::_initSeq[] = {OP_READ_ID, OP_DISC_DESCRIPS, OP_WRITE_CCCD, OP_READ_STATE};
+const GattOpType_t BLERemDev::_reconSeq[] = {OP_WRITE_CCCD, OP_READ_STATE};
+// with the aggregated state only the ids are needed per accessory - and nothing on reconnection
+const GattOpType_t BLERemDev::_initSeqAgg[] = {OP_READ_ID};
+
+// queue the initialisation operations for as many accessories as there is room for
+// _fillStep is the position in the sequence and _remAcc is the next accessory for that step
+void BLERemDev::_fillOps()
+{
+    const GattOpType_t* seq = _reconSeq;
+    uint8_t steps = sizeof(_reconSeq) / sizeof(_reconSeq[0]);
+    GattAttribute::Handle_t h;
+    
+    if (_clientConState == CS_CON_INIT)
+    {
+        seq = _useAgg?_initSeqAgg:_initSeq;
+        steps = _useAgg?(sizeof(_initSeqAgg) / sizeof(_initSeqAgg[0])):(sizeof(_initSeq) / sizeof(_initSeq[0]));
+    }
+    else if (_useAgg || (_clientConState == CS_CACHE_CHECK))
+    {
+        steps = 0;  // everything queued at the start
+    }
+    while ((_fillStep < steps) && (_opCount < MAX_GATT_OPS))
+    {
+        if (_remAcc == nullptr)
+        {
+            // all accessories done for this step - on to the next
+            _fillStep++;
+            _remAcc = _firstRemAcc;
+            continue;
+        }
+        switch (seq[_fillStep])
+        {
+            case OP_READ_ID:
+                h = _remAcc->idValueHandle();
+                break;
+                
+            case OP_READ_STATE:
+            case OP_DISC_DESCRIPS:
+                h = _remAcc->stateValueHandle();
+                break;
+                
+            default:
+                // CCCD handle resolved when issued - it may not be known yet
+                h = GattAttribute::INVALID_HANDLE;
+                break;
+        }
+        _queueOp(seq[_fillStep], _remAcc, h);
+        _remAcc = _nextRemAcc(_remAcc);  // move on to this connection's next accessory
+    }
+}
+
+// issue the operation at the head of the queue
+// operations that fail, or stay busy for longer than the retry limit, are skipped
+void BLERemDev::_issueOps()
+{
+    ble_error_t bleErr;
+    
+    _retryPending = false;
+    while ((_opCount > 0) && !_opInFlight)
+    {
+        GattOp_t& op = _ops[_opHead];
+        switch (op.type)
+        {
+            case OP_READ_NAME:
+            case OP_READ_ID:
+            case OP_READ_STATE:
+            case OP_READ_AGG:
+            case OP_CHECK_ID:
+            case OP_CHECK_AGG:
+                bleErr = _gattClient.read(_connHandle, op.handle, 0);
+                break;
+                
+            case OP_DISC_AGG_DESCRIPS:
+                _aggCCCDH = GattAttribute::INVALID_HANDLE;
+                bleErr = _aggStateDC.discoverDescriptors
+                (
+                 CharacteristicDescriptorDiscovery::DiscoveryCallback_t
+                 (
+                  this,
+                  &BLERemDev::_aggDescripDisc),
+                 CharacteristicDescriptorDiscovery::TerminationCallback_t
+                 (
+                  this,
+                  &BLERemDev::_aggDDDone)
+                 );
+                break;
+                
+            case OP_WRITE_AGG_CCCD:
+                op.handle = _aggCCCDH;
+                bleErr = _writeAggCCCD();
+                break;
+                
+            case OP_DISC_DESCRIPS:
+            {
+                // rebuild the state characteristic from its handles - the accessory's position on
+                // this connection gives its last handle
+                unsigned int i = 0;
+                for (RemAccessory* remAcc = _firstRemAcc; (remAcc != nullptr) && (remAcc != op.remAcc);
+                     remAcc = _nextRemAcc(remAcc))
+                {
+                    i++;
+                }
+                bleErr = BLE_ERROR_INVALID_PARAM;
+                if ((i < _countDA) && (op.handle != GattAttribute::INVALID_HANDLE) &&
+                    (_stateLastH[i] != GattAttribute::INVALID_HANDLE))
+                {
+                    HandleCharac_t stateDC(_connHandle, op.handle, _stateLastH[i]);
+                    bleErr = op.remAcc->processDescrips
+                    (
+                     stateDC,
+                     mbed::callback(this, &BLERemDev::_descripsDone)
+                     );
+                }
+                break;
+            }
+                
+            case OP_WRITE_CCCD:
+                op.handle = op.remAcc->stateCCCDHandle();
+                bleErr = op.remAcc->doCCCDwrite();
+                break;
+                
+            default:
+                bleErr = BLE_ERROR_INVALID_PARAM;
+                break;
+        }
+        if (bleErr == BLE_ERROR_NONE)
+        {
+            _opInFlight = true;  // wait for completion callback
+            _retryCount = 0;
+        }
+        else if ((bleErr == BLE_ERROR_BUSY) && (_retryCount < GATT_MAX_RETRIES))
+        {
+            // another procedure is running on this connection - try again shortly
+            if (!_retryPending)
+            {
+                _retryPending = true;
+                _retryCount++;
+                BLEcore::instance().getEventQueue()->call_in
+                (
+                 std::chrono::milliseconds(GATT_RETRY_MS),
+                 mbed::callback(this, &BLERemDev::_issueOps)
+                 );
+            }
+            return;
+        }
+        else
+        {
+            // invalid state (e.g. link going down) or still busy after the retries - skip it
+#if DEBUG
+            Serial.print("GATT op ");
+            Serial.print(op.type);
+            Serial.print(" error:");
+            Serial.println(bleErr);
+#endif
+            if ((op.type == OP_CHECK_ID) || (op.type == OP_CHECK_AGG))
+            {
+                _cacheValid = false;
+            }
+            _opHead = (_opHead + 1) % MAX_GATT_OPS;
+            _opCount--;
+            _retryCount = 0;
+            _fillOps();
+        }
+    }
+    if ((_opCount == 0) && !_opInFlight)
+    {
+        _initDone();
+    }
+}
+
+// the operation in flight has completed - issue the next
+void BLERemDev::_opDone()
+{
+    _opInFlight = false;
+    _opHead = (_opHead + 1) % MAX_GATT_OPS;
+    _opCount--;
+    _fillOps();
+    _issueOps();
+}
+
+// all initialisation operations complete
+void BLERemDev::_initDone()
+{
+    if (_clientConState == CS_CACHE_CHECK)
+    {
+        _checkCache();  // all the check reads done
+        return;
+    }
+    if ((_clientConState != CS_CON_INIT) && (_clientConState != CS_RECON_INIT))
+    {
+        return;  // not initialising
+    }
+    // setting up discovered accessories complete
+    // queue connected report for each of the remote accessories on this connection
+    // but we do this last to ensure stack is now idle
+    _queueRemAccReps(RA_CONNECTED, _connHandle);
+
+#if DEBUG
+    Serial.println("All DAs done");
+#endif
+    if (_clientConState == CS_CON_INIT)
+    {
+        _saveCache();  // so discovery can be skipped next time
+    }
+    _clientConState = CS_CONNECTED; // set connected
+    // and report that all service interrogation and setup complete
+    BLEcore::instance().queueReport(BLE_SERVICES_AVAIL, 0);
+}
+
+
+/*
+ ********************************************************
+ aggregated state
+ 
+ If the controller has a controller service its aggregated state characteristic holds the state of all its
+ accessories, one byte each in handle order.  That is the order the accessory services are discovered and so
+ the order of this connection's list.  It is read and subscribed to in place of each accessory's state.
+ ********************************************************
+ */
+
+// pass the aggregated state to the accessories
+// if notified, states that have changed are reported
+void BLERemDev::_aggStateUpdate(const uint8_t* data, uint16_t len, bool notified)
+{
+    uint16_t i = 0;
+    
+    for (RemAccessory* remAcc = _firstRemAcc; (remAcc != nullptr) && (i < len); remAcc = _nextRemAcc(remAcc))
+    {
+        if (!notified)
+        {
+            remAcc->setState((PointState_t)data[i]);
+        }
+        else if (remAcc->getState() != (PointState_t)data[i])
+        {
+            remAcc->newState((PointState_t)data[i]);
+        }
+        i++;
+    }
+}
+
+// aggregated state descriptor found - save the CCCD handle
+void BLERemDev::_aggDescripDisc(const CharacteristicDescriptorDiscovery::DiscoveryCallbackParams_t* cbp)
+{
+    if (cbp->descriptor.getUUID() == UUID(BLE_UUID_DESCRIPTOR_CLIENT_CHAR_CONFIG))
+    {
+        _aggCCCDH = cbp->descriptor.getAttributeHandle();
+    }
+}
+
+// aggregated state descriptor discovery complete
+void BLERemDev::_aggDDDone(const CharacteristicDescriptorDiscovery::TerminationCallbackParams_t*)
+{
+    if (_opInFlight && (_opCount > 0) && (_ops[_opHead].type == OP_DISC_AGG_DESCRIPS))
+    {
+        _opDone();
+    }
+}
+
+// write the aggregated state CCCD to enable notifications
+ble_error_t BLERemDev::_writeAggCCCD()
+{
+    uint16_t hvNotification = 1;
+    
+    if (_aggCCCDH == GattAttribute::INVALID_HANDLE)
+    {
+        return(BLE_ERROR_INVALID_PARAM);
+    }
+    return(_gattClient.write(GattClient::GATT_OP_WRITE_REQ,
+                             _connHandle,
+                             _aggCCCDH,
+                             sizeof(hvNotification),
+                             reinterpret_cast<uint8_t*>(&hvNotification)));
+}
+
+// description discovery for the accessory at the head of the queue has terminated
+void BLERemDev::_descripsDone()
 {
 #if DEBUG
-    Serial.print("Next DA - done ");
-    Serial.print((char)_remAcc->getType());
-    Serial.println(_remAcc->getId());
+        Serial.println("Descrips Done");
 #endif
-    Reporter* nextReporter = _remAcc->getNextReporter();  // start search from the one just done
+    if (_opInFlight && (_opCount > 0) && (_ops[_opHead].type == OP_DISC_DESCRIPS))
+    {
+        _opDone();
+    }
+}
+    
+// each connection keeps a list of its own accessories linked through the accessories
+// so that connection events only touch this peer's accessories
+
+// add a newly found accessory to the end of this connection's list
+void BLERemDev::_addRemAcc(RemAccessory* remAcc)
+{
+    remAcc->setConnection(this, _connHandle);
+    remAcc->setNextOnConn(nullptr);
+    if (_lastRemAcc == nullptr)
+    {
+        _firstRemAcc = remAcc;
+    }
+    else
+    {
+        _lastRemAcc->setNextOnConn(remAcc);
+    }
+    _lastRemAcc = remAcc;
+    _countDA++;
+}
+
+// next accessory on the same connection
+RemAccessory* BLERemDev::_nextRemAcc(RemAccessory* remAcc)
+{
+    return((RemAccessory*)remAcc->getNextOnConn());
+}
+
+void BLERemDev::_queueRemAccReps(EventType repType, const int info)
+{
+    for (RemAccessory* remAcc = _firstRemAcc; remAcc != nullptr; remAcc = _nextRemAcc(remAcc))
+    {
+        if(repType == RA_DISCONNECTED)
+        {
+            remAcc->setState(P_UNAVAIL);
+        }
+        remAcc->queueReport(repType, info);
+    }
+}
+
+// set the connection handle for each of this connection's accessories
+// NO_CONN_HANDLE is used when disconnected so stale handles can't match
+// another connection's events
+void BLERemDev::_setRemAccConn(const ble::connection_handle_t ch)
+{
+    for (RemAccessory* remAcc = _firstRemAcc; remAcc != nullptr; remAcc = _nextRemAcc(remAcc))
+    {
+        remAcc->setConnection(this, ch);
+    }
+}
+
+/*
+ ********************************************************
+ handle cache
+ 
+ The handles found by discovery and the accessory ids are saved in KVStore
+ keyed on the peer address.  After power on the first connection to a known
+ peer restores the accessories from the cache and checks the first id still
+ reads back as saved.  If so discovery is skipped and the reconnect path is
+ used.  Otherwise the cache entry is discarded and discovery is done.
+ ********************************************************
+ */
+
+// build the KVStore key for this peer - "/kv/daws" + address type + address
+void BLERemDev::_cacheKey(char* key)
+{
+    static const char hex[] = "0123456789abcdef";
+    char* kp = key;
     
-    while ((nextReporter != nullptr) &&
-           ((nextReporter->getType() != RA_REP) ||
-            (!(((RemAccessory*)nextReporter)->initCharacteristics(_clientConState)))))
+    strcpy(kp, "/kv/daws");
+    kp += strlen(kp);
+    *kp++ = hex[_peerAddType.value() & 0xf];
+    for (size_t x = 0; x < _peerAdd.size(); x++)
     {
-        // unable to initiate processing characteristics - skip to next
-        nextReporter = nextReporter->getNextReporter();
+        *kp++ = hex[_peerAdd[x] >> 4];
+        *kp++ = hex[_peerAdd[x] & 0xf];
     }
+    *kp = '\0';
+}
+
+// restore accessories from the cache and issue the check read
+// returns false if there is no usable cache entry
+bool BLERemDev::_restoreFromCache()
+{
+#if HANDLE_CACHE
+    char key[CACHE_KEY_SIZE];
+    HandleCache_t cache;
+    size_t actual = 0;
+    RemAccessory* remAcc;
     
+    _cacheKey(key);
+    if ((kv_get(key, &cache, sizeof(cache), &actual) != MBED_SUCCESS) ||
+        (actual != sizeof(cache)) ||
+        (cache.version != HANDLE_CACHE_VERSION) ||
+        (cache.countDA == 0) ||
+        (cache.countDA > MAX_DISCOVERED_ACCESSORY) ||
+        (cache.aggH == GattAttribute::INVALID_HANDLE))
+    {
+        return(false);
+    }
+    _discardRemAccs();
+    for (uint16_t i = 0; i < cache.countDA; i++)
+    {
+        // as for discovery, remote accessories come from the pool
+        cache.acc[i].id[MAX_ID_SIZE - 1] = '\0';
+        remAcc = _allocRemAcc(cache.acc[i].id);
+        if (remAcc == nullptr)
+        {
+            _discardRemAccs();
+            return(false);
+        }
+        remAcc->initSvr(_connHandle);
+        _addRemAcc(remAcc);
+        remAcc->restoreHandles(cache.acc[i].idH, cache.acc[i].stateH,
+                               cache.acc[i].cmdH, cache.acc[i].cccdH,
+                               cache.acc[i].cmdNoRsp);
+        remAcc->setRemAccId((const uint8_t*)cache.acc[i].id, strnlen(cache.acc[i].id, MAX_ID_SIZE));
+    }
+    _aggStateH = cache.aggH;
+    _aggCCCDH = cache.aggCCCDH;
+    _routeH = cache.routeH;
+    _useAgg = AGG_STATE && (_aggStateH != GattAttribute::INVALID_HANDLE);
     
-    if (nextReporter  == nullptr)
+    // check every accessory's id still reads back the same and that the aggregated state
+    // still has one byte per cached accessory i.e. no accessory service added or removed
+    _opHead = _opCount = 0;
+    _opInFlight = false;
+    _retryCount = 0;
+    _cacheValid = true;
+    for (remAcc = _firstRemAcc; remAcc != nullptr; remAcc = _nextRemAcc(remAcc))
     {
-        // setting up discovered accessories complete
-        // queue connected report for each of the remote accessories on this connection
-        // but we do this last to ensure stack is now idle
-        _queueRemAccReps(RA_CONNECTED, _connHandle);
+        _queueOp(OP_CHECK_ID, remAcc, remAcc->idValueHandle());
+    }
+    _queueOp(OP_CHECK_AGG, nullptr, _aggStateH);
+#if DEBUG
+    Serial.print(_countDA);
+    Serial.println(" accessories restored from cache");
+#endif
+    return(true);
+#else
+    return(false);
+#endif
+}
 
+// check reads complete - if everything matched carry on as for a reconnect
+// otherwise throw the cache away and do discovery
+void BLERemDev::_checkCache()
+{
+    if (_cacheValid)
+    {
 #if DEBUG
-        Serial.println("All DAs done");
+        Serial.println("Handle cache valid : service discovery skipped");
 #endif
-        _clientConState = CS_CONNECTED; // set connected
-        // and report that all service interrogation and setup complete
-        BLEcore::instance().queueReport(BLE_SERVICES_AVAIL, 0);
+        // report the accessories as discovery would have done
+        _queueRemAccReps(RA_DISCOVERED, 0);
+        _startReconInit();
     }
     else
     {
-        _remAcc = (RemAccessory*)nextReporter;
 #if DEBUG
-        
-        Serial.print("Next DA - found ");
-        Serial.print((char)_remAcc->getType());
-        Serial.println(_remAcc->getId());
+        Serial.println("Handle cache stale : doing service discovery");
+#endif
+        _discardRemAccs();
+#if HANDLE_CACHE
+        if (!core_util_atomic_load_bool(&_cacheWritePending))
+        {
+            _cacheSave.countDA = 0;  // remove the entry
+            _queueCacheWrite();
+        }
 #endif
+        _startDiscovery();
     }
-    // otherwise wait for appropriate action complete callback
 }
 
+// save the handles and ids of this connection's accessories
+// the snapshot is taken here but written to flash later, off the BLE thread
+void BLERemDev::_saveCache()
+{
+#if HANDLE_CACHE
+    HandleCache_t& cache = _cacheSave;
+    uint16_t i = 0;
+    RemAccessory* remAcc = _firstRemAcc;
+    
+    if ((_countDA > MAX_DISCOVERED_ACCESSORY) ||
+        (_aggStateH == GattAttribute::INVALID_HANDLE) ||
+        core_util_atomic_load_bool(&_cacheWritePending))
+    {
+        // too many to cache, no aggregated state to check the accessory count against
+        // or the last snapshot is still being written
+        return;
+    }
+    memset(&cache, 0, sizeof(cache));
+    cache.version = HANDLE_CACHE_VERSION;
+    cache.aggH = _aggStateH;
+    cache.aggCCCDH = _aggCCCDH;
+    cache.routeH = _routeH;
+    while ((remAcc != nullptr) && (i < MAX_DISCOVERED_ACCESSORY))
+    {
+        cache.acc[i].idH = remAcc->idValueHandle();
+        cache.acc[i].stateH = remAcc->stateValueHandle();
+        cache.acc[i].cmdH = remAcc->cmdValueHandle();
+        cache.acc[i].cccdH = remAcc->stateCCCDHandle();
+        cache.acc[i].cmdNoRsp = remAcc->cmdNoRsp();
+        strncpy(cache.acc[i].id, remAcc->getRemAccId(), MAX_ID_SIZE);
+        i++;
+        remAcc = _nextRemAcc(remAcc);
+    }
+    cache.countDA = i;
+    _queueCacheWrite();
+#endif
+}
 
-// only called if description discovery terminated with error
-void BLERemDev::_descripsDone()
+// hand the snapshot to the shared event queue - a flash write can block for milliseconds
+// and must not hold up the BLE thread
+void BLERemDev::_queueCacheWrite()
 {
-#if DEBUG
-        Serial.println("Descrips Done");
+#if HANDLE_CACHE
+    _cacheKey(_cacheSaveKey);
+    core_util_atomic_store_bool(&_cacheWritePending, true);
+    if (mbed::mbed_event_queue()->call(mbed::callback(this, &BLERemDev::_writeCache)) == 0)
+    {
+        core_util_atomic_store_bool(&_cacheWritePending, false);  // queue full - not saved this time
+    }
 #endif
 }
+
+// write or remove the cache entry - shared event queue thread
+void BLERemDev::_writeCache()
+{
+#if HANDLE_CACHE
+    int err;
     
-void BLERemDev::_queueRemAccReps(EventType repType, const int info)
+    if (_cacheSave.countDA == 0)
+    {
+        err = kv_remove(_cacheSaveKey);
+    }
+    else
+    {
+        err = kv_set(_cacheSaveKey, &_cacheSave, sizeof(_cacheSave), 0);
+    }
+#if DEBUG
+    Serial.print("Handle cache write status ");
+    Serial.println(err);
+#endif
+    (void)err;
+    core_util_atomic_store_bool(&_cacheWritePending, false);  // snapshot free again
+#endif
+}
+
+// detach this connection's accessories - e.g. restored from a stale cache
+// n.b. they remain in the reporter chain but no longer belong to any connection
+// and are returned to the pool for reuse
+void BLERemDev::_discardRemAccs()
 {
-    // search for the remote corresponding to this discovered accessory
-    Reporter* nextReporter = Reporter::getFirstReporter();
-    while (nextReporter != nullptr)
+    RemAccessory* remAcc = _firstRemAcc;
+    RemAccessory* nextRemAcc;
+    while (remAcc != nullptr)
     {
-        if ((nextReporter->getType() == RA_REP) &&
-            (((RemAccessory*)nextReporter)->getConnHandle() ==
-             _connHandle))
+        nextRemAcc = _nextRemAcc(remAcc);
+        remAcc->setConnection(nullptr, NO_CONN_HANDLE);
+        remAcc->setState(P_UNAVAIL);
+        remAcc->setNextOnConn(nullptr);
+        for (int i = 0; i < ACC_POOL_SIZE; i++)
         {
-            if(repType == RA_DISCONNECTED)
+            if (_accSlot[i].remAcc == remAcc)
             {
-                ((RemAccessory*)nextReporter)->setState(P_UNAVAIL);
+                _accSlot[i].inUse = false;
+                _accInUse--;
+                break;
             }
-            nextReporter->queueReport(repType, info);
         }
-            
-            // no match - look at next one
-        nextReporter = nextReporter->getNextReporter();
+        remAcc = nextRemAcc;
     }
+    _firstRemAcc = _lastRemAcc = nullptr;
+    _countDA = 0;
 }
+
+/*
+ ********************************************************
+ remote accessory pool
+ 
+ Remote accessories are constructed in place in a fixed pool the first time a slot is used.  They are never
+ destroyed as they are linked into the reporter chain.  A released accessory is reused, preferably for the same
+ peer and id, then for the same peer.  Unused slots are taken next, and as a last resort an accessory released
+ by another peer.
+ 
+ The id is only known when the accessories are restored from the handle cache, and only then is the same
+ accessory given back for the same id.  During discovery the id has not been read yet, so any accessory released
+ by the same peer may be reused - it takes the id read from the server.  An application pointer held across a
+ disconnect may then refer to a different accessory, so look accessories up by id again after reconnection.
+ ********************************************************
+ */
+
+// get an accessory for this connection - id is nullptr if not known yet
+// returns nullptr if the pool is exhausted
+RemAccessory* BLERemDev::_allocRemAcc(const char* id)
+{
+    int slot = -1;
+    
+    for (int i = 0; i < ACC_POOL_SIZE; i++)
+    {
+        if ((_accSlot[i].remAcc == nullptr) || _accSlot[i].inUse ||
+            (_accSlot[i].peerAdd != _peerAdd))
+        {
+            continue;
+        }
+        if ((id == nullptr) ||
+            (strcmp(_accSlot[i].remAcc->getRemAccId(), id) == 0))
+        {
+            slot = i;  // same peer - and same id if known, otherwise the id may change
+            break;
+        }
+        if (slot < 0)
+        {
+            slot = i;  // same peer - use it if the id isn't found
+        }
+    }
+    for (int i = 0; (slot < 0) && (i < ACC_POOL_SIZE); i++)
+    {
+        if (_accSlot[i].remAcc == nullptr)
+        {
+            _accSlot[i].remAcc = new (_accMem[i]) RemAccessory(NO_CONN_HANDLE);
+            slot = i;
+        }
+    }
+    for (int i = 0; (slot < 0) && (i < ACC_POOL_SIZE); i++)
+    {
+        if (!_accSlot[i].inUse)
+        {
+            slot = i;  // released by another peer - its id no longer applies
+            _accSlot[i].remAcc->setRemAccId((const uint8_t*)"", 0);
+        }
+    }
+    if (slot < 0)
+    {
+#if DEBUG
+        Serial.println("Remote accessory pool exhausted");
+#endif
+        return(nullptr);
+    }
+    _accSlot[slot].inUse = true;
+    _accSlot[slot].peerAdd = _peerAdd;
+    if (++_accInUse > _accHighWater)
+    {
+        _accHighWater = _accInUse;
+    }
+    return(_accSlot[slot].remAcc);
+}
+
+#endif /* DAWS_CENTRAL */
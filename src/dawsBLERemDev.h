@@ -32,8 +32,101 @@
 //#define STATE_ATTRIBUTE_COUNT 1
 //#define CMD_ATTRIBUTE_COUNT 1
 
-#define MAX_DISCOVERED_ACCESSORY 4 ///< number of discovered accessories per connection
-#define MAX_REMOTE_CON 5 ///< number of remote connections
+// capacities are set in dawsConfig.h
+#define CACHE_KEY_SIZE 24 ///< handle cache key size - "/kv/daws", type, address and terminator
+#define OPS_PER_ACC 4 ///< GATT operations to initialise an accessory - id, state, descriptors and CCCD
+#define MAX_GATT_OPS (OPS_PER_ACC * MAX_DISCOVERED_ACCESSORY + 4) ///< GATT operation queue size - plus device name and aggregated state
+#define GATT_RETRY_MS 5 ///< delay before retrying a GATT operation when the stack is busy
+#define GATT_MAX_RETRIES 40 ///< busy retries before a GATT operation is abandoned
+#define ACC_POOL_SIZE (MAX_DISCOVERED_ACCESSORY * MAX_REMOTE_CON) ///< remote accessory pool size - all connections
+
+class BLERemDev;
+
+/**
+ @brief Connection latency profiles
+ 
+ Named sets of connection parameters.  The profile may be changed while connected, e.g. low latency while a route
+ is being set and low power while idle.
+ */
+enum ConnProfile_t :byte
+{
+    CP_LOW_LATENCY,   ///< 7.5 - 15 ms interval, no peripheral latency
+    CP_STANDARD,      ///< 100 - 200 ms interval, no peripheral latency (the default)
+    CP_LOW_POWER,     ///< 200 - 400 ms interval, peripheral may skip 4 events
+    CP_MAX            ///< boundary value for size etc
+};
+
+/**
+ @brief GATT client operations
+ 
+ The operations queued to initialise the accessories on a connection.
+ */
+enum GattOpType_t :byte
+{
+    OP_READ_NAME,      ///< read the device name
+    OP_READ_ID,        ///< read an accessory id
+    OP_DISC_DESCRIPS,  ///< discover the state characteristic descriptors to find the CCCD
+    OP_READ_STATE,     ///< read an accessory state
+    OP_WRITE_CCCD,     ///< write the state CCCD to enable notifications
+    OP_READ_AGG,       ///< read the controller's aggregated state
+    OP_DISC_AGG_DESCRIPS,  ///< discover the aggregated state descriptors to find the CCCD
+    OP_WRITE_AGG_CCCD, ///< write the aggregated state CCCD to enable notifications
+    OP_CHECK_ID,       ///< read back an accessory id restored from the handle cache
+    OP_CHECK_AGG       ///< read the aggregated state to check the cached accessory count
+};
+
+/**
+ @brief Route step
+ 
+ An accessory and the position it is to be set to, as part of a route.
+ 
+ @see BLERemDev::setRoute
+ */
+struct RouteStep_t
+{
+    const char* id;   ///< accessory id
+    PointPos_t pos;   ///< required position
+};
+
+/**
+ @brief Targeted discovery passes
+ */
+enum DiscPass_t :byte
+{
+    DP_NONE,   ///< not doing targeted discovery
+    DP_GAP,    ///< GAP service - device name
+    DP_ACC,    ///< accessory services
+    DP_CTL     ///< controller service
+};
+
+/**
+ @brief Peer found by scanning
+ 
+ A record of an accessory controller found by scanning.  Records are held in an open addressed table keyed on the
+ peer address and address type so repeated advertising reports are rejected in constant time.  The local name is held
+ inline.  A connection object is only assigned when the peer is first connected.
+ */
+struct BLEPeer_t
+{
+    ble::address_t peerAdd;                   ///< peer address
+    ble::peer_address_type_t peerAddType;     ///< peer address type
+    char localName[MAX_NAME_SIZE];            ///< local name as advertised
+    BLERemDev* remDev;                        ///< connection object - nullptr if not connected yet
+    bool inUse;                               ///< true if the table slot is occupied
+};
+
+/**
+ @brief Remote accessory pool slot
+ 
+ Remote accessories are constructed in a fixed pool rather than on the heap.  Once constructed an accessory stays
+ in the reporter chain, so a released accessory is kept and reused, preferably for the same peer and id.
+ */
+struct AccSlot_t
+{
+    RemAccessory* remAcc;       ///< constructed accessory - nullptr if the slot has never been used
+    ble::address_t peerAdd;     ///< address of the peer the accessory was last found on
+    bool inUse;                 ///< true if the accessory belongs to a connection
+};
 
 
 
@@ -46,12 +139,13 @@
  provides services which central accesses as a client.
  For DAWS we expect a single instance of the generic gap service and multiple instances of the DAWS accessory service.
  
- At the moment we work on the basis that there will only be one client connection
- open at a time.  This is as the current connection should always
- be within range whereas other potential connections may not be.
+ Several client connections may be open at once, up to the number of connection objects and the controller's
+ limit.  Each connection has its own state machine.  Each connection owns its BLE core connection so connection and
+ disconnection events come straight to it.  GATT client events are routed to the owning connection by connection handle.
  
- Discovery is performed the first time a connection is made to a remote BLE peripheral server after power on.  Discovery is
- not re-performed on re-connection.
+ Discovery is performed the first time a connection is made to a remote BLE peripheral server.  Discovery is
+ not re-performed on re-connection.  The handles found are saved by peer address so that after power on, once a quick
+ check shows they are still valid, discovery can be skipped.
  
  Discovery is event driven using mbed BLE call backs.
  
@@ -60,7 +154,7 @@
  
  */
 
-class BLERemDev
+class BLERemDev: public BLEConnOwner
 {
 public:
     BLERemDev(const uint8_t*, const ble::peer_address_type_t);
@@ -69,14 +163,34 @@ public:
 
     static void setAdReporting();
     static bool connectByIndex(int);
-    static bool connectByName(String&);
-    static String& getLocalNameByIndex(int);
+    static bool connectByName(const char*);
+#if DAWS_STRING_API
+    static bool connectByName(const String&);
+#endif
+    static const char* getLocalNameByIndex(int);
+#if DAWS_STRING_API
+    static String getLocalNameStringByIndex(int);
+#endif
     static void disconnect();
+    static bool disconnectByIndex(int);
     static int getFoundCount();
     static BLERemDev* activeRemDev();
+    static bool setRoute(const RouteStep_t*, int, mbed::Callback<void(bool)> = nullptr);
+    static int getAccPoolHighWater();
 
     
-    String& getLocalName();
+    const char* getLocalName();
+#if DAWS_STRING_API
+    String getLocalNameString();
+#endif
+    
+    void onConnected(const ble::ConnectionCompleteEvent&) override;
+    void onDisconnected(const ble::DisconnectionCompleteEvent&) override;
+    void onParamsUpdated(const ble::ConnectionParametersUpdateCompleteEvent&) override;
+    
+    bool setConnProfile(ConnProfile_t);
+    ConnProfile_t getConnProfile();
+    uint32_t getConnIntervalUs();
 
     //ble::connection_handle_t getConnHandle();
     
@@ -95,25 +209,138 @@ private:
     void _dataRead(const GattReadCallbackParams*);
     void _dataWritten(const GattWriteCallbackParams*);
     void _discoveryTermination(const ble::connection_handle_t);
-    void _doNextDA();
     void _descripsDone();
+    void _setRemAccConn(const ble::connection_handle_t);
+    void _startDiscovery();
+    ble_error_t _launchDiscovery(const UUID&, const UUID&);
+    void _discoverNextPass();
+    void _startReconInit();
+    void _discardRemAccs();
+    
+    // GATT operation queue - initialisation reads and writes issued back to back
+    struct GattOp_t
+    {
+        GattOpType_t type;                 // operation
+        RemAccessory* remAcc;              // accessory concerned - nullptr for device name
+        GattAttribute::Handle_t handle;    // attribute handle - completion is matched on this
+    };
+    GattOp_t _ops[MAX_GATT_OPS];   // ring buffer
+    uint8_t _opHead;               // operation in flight or next to be issued
+    uint8_t _opCount;              // operations queued
+    bool _opInFlight;              // head operation issued - waiting for completion
+    bool _retryPending;            // retry scheduled after busy
+    uint8_t _retryCount;           // busy retries of the head operation
+    uint8_t _fillStep;             // position in the operation sequence still to be queued
+    static const GattOpType_t _initSeq[];   // operation sequence for initial connection
+    static const GattOpType_t _reconSeq[];  // operation sequence for reconnection
+    static const GattOpType_t _initSeqAgg[];  // operation sequence for initial connection with aggregated state
+    
+    // controller aggregated state - used in place of accessory states if available
+    DiscoveredCharacteristic _aggStateDC;   // as discovered - for descriptor discovery
+    GattAttribute::Handle_t _stateLastH[MAX_DISCOVERED_ACCESSORY];  // accessory state last handles - for descriptor discovery
+    GattAttribute::Handle_t _aggStateH;     // value handle - INVALID_HANDLE if none
+    GattAttribute::Handle_t _aggCCCDH;      // CCCD handle
+    bool _useAgg;                           // aggregated state in use on this connection
+    void _aggStateUpdate(const uint8_t*, uint16_t, bool);
+    void _aggDescripDisc(const CharacteristicDescriptorDiscovery::DiscoveryCallbackParams_t*);
+    void _aggDDDone(const CharacteristicDescriptorDiscovery::TerminationCallbackParams_t*);
+    ble_error_t _writeAggCCCD();
+    
+    // controller route command
+    GattAttribute::Handle_t _routeH;        // value handle - INVALID_HANDLE if none
+    uint8_t _routeBuf[ROUTE_SIZE(MAX_ROUTE_STEPS)];  // route steps for this remote device
+    bool _routePending;                     // route write awaiting response
+    static int _routeOutstanding;           // route writes awaiting response - all connections - BLE thread only
+    static volatile bool _routeBusy;        // set by setRoute, cleared when the route has completed
+    static bool _routeOK;
+    static mbed::Callback<void(bool)> _routeDoneCB;
+    static void _sendRoute();
+    static void _routeWriteDone(bool);
+    bool _queueOp(GattOpType_t, RemAccessory*, GattAttribute::Handle_t);
+    void _fillOps();
+    void _issueOps();
+    void _opDone();
+    void _initDone();
+    
+    // handle cache - discovered handles and ids saved by peer address
+    struct HandleCache_t
+    {
+        uint16_t version;       // cache layout version
+        uint16_t countDA;       // number of accessories saved
+        struct
+        {
+            GattAttribute::Handle_t idH;     // id value handle
+            GattAttribute::Handle_t stateH;  // state value handle
+            GattAttribute::Handle_t cmdH;    // command value handle
+            GattAttribute::Handle_t cccdH;   // state CCCD handle
+            char id[MAX_ID_SIZE];            // accessory id
+            bool cmdNoRsp;                   // command allows write without response
+        } acc[MAX_DISCOVERED_ACCESSORY];
+        GattAttribute::Handle_t aggH;        // aggregated state value handle
+        GattAttribute::Handle_t aggCCCDH;    // aggregated state CCCD handle
+        GattAttribute::Handle_t routeH;      // route command value handle
+    };
+    void _cacheKey(char*);
+    bool _restoreFromCache();
+    void _checkCache();
+    bool _cacheValid;                        // no cache check read has failed so far
+    void _saveCache();
+    void _queueCacheWrite();
+    void _writeCache();
+    HandleCache_t _cacheSave;                // snapshot waiting to be written
+    char _cacheSaveKey[CACHE_KEY_SIZE];      // and its key
+    volatile bool _cacheWritePending;        // snapshot handed to the shared event queue
+    
+    // static routing of GATT client events to connections
+    static void _setCallbacks();
+    static BLERemDev* _findByHandle(const ble::connection_handle_t);
+    static void _onDiscoveryTermination(const ble::connection_handle_t);
+    static void _onDataRead(const GattReadCallbackParams*);
+    static void _onDataWritten(const GattWriteCallbackParams*);
+    static void _onHVX(const GattHVXCallbackParams*);
+    
+    // connection parameters for each profile
+    struct ConnParams_t
+    {
+        uint16_t minInterval;   // minimum connection interval (1.25 ms units)
+        uint16_t maxInterval;   // maximum connection interval (1.25 ms units)
+        uint16_t latency;       // peripheral latency (connection events)
+        uint16_t timeout;       // supervision timeout (10 ms units)
+    };
+    static const ConnParams_t _connParams[];
+    
+    ConnProfile_t _connProfile;     // profile in use
+    ConnProfile_t _reqProfile;      // profile requested - in use once the update completes
+    uint16_t _connInterval;         // connection interval in use (1.25 ms units)
     
     // fields set up from scan reports
-    String _localName;
+    char _localName[MAX_NAME_SIZE];  // copied from the peer table when assigned
     ble::address_t _peerAdd;  // remote address
     ble::peer_address_type_t _peerAddType; // remote address type
     
     
     static void _processScanReport(const ble::AdvertisingReportEvent&);
+    static unsigned int _findPeer(const ble::address_t&, const ble::peer_address_type_t);
+    static BLERemDev* _assignRemDev(BLEPeer_t&);
     void _queueRemAccReps(EventType, const int);
     
-    static BLERemDev* _activeRemDev;  // pointer to active client connection
+    static BLERemDev* _activeRemDev;  // pointer to most recently connected client connection
 
     
     ble::connection_handle_t _connHandle;  // con handle
     
     RemAccessory* _remAcc;
-    RemAccessory* _firstRemAcc;
+    RemAccessory* _firstRemAcc;   // this connection's accessories - linked through the accessories
+    RemAccessory* _lastRemAcc;
+    void _addRemAcc(RemAccessory*);
+    static RemAccessory* _nextRemAcc(RemAccessory*);
+    RemAccessory* _allocRemAcc(const char*);
+    
+    // remote accessory pool - all connections
+    static AccSlot_t _accSlot[];
+    alignas(RemAccessory) static uint8_t _accMem[][sizeof(RemAccessory)];
+    static int _accInUse;       // accessories currently belonging to connections
+    static int _accHighWater;   // most accessories in use at once
 
     //unsigned int _nextDA; // next element in DA array to be processed
     unsigned int _countDA;  // number of DAs on this connection
@@ -131,12 +358,18 @@ private:
     // variables related to service discovery on the current connection
     
     UUID _serviceUUID;  // service UUID of the service currently undergoing discovery
+    DiscPass_t _discPass;  // targeted discovery pass in progress
     
-    // array of remote devices as found during scans.
+    // peers as found during scans
+    static BLEPeer_t _peerTab[];   // open addressed peer table
+    static uint8_t _peerOrder[];   // peer table slots in the order found
+    static int _peerCount;         // number of peers found by scanning
     
-    static BLERemDev _bleCon[];  // but only one used at the moment!
-    static int _bleConCount; // number connections in discovered by scanning
+    // connection objects - assigned to peers on first connection
+    static BLERemDev _bleCon[];  // any or all may be connected at once
+    static int _bleConCount; // number of connection objects assigned
     static bool _scanRepCBset;  // set to indicate callback has been set up
+    static bool _conCBset;      // set once GATT client event routing has been set up
 };
 
 
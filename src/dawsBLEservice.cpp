@@ -44,6 +44,8 @@
 
 #define DEBUG false  ///< enable BLE debug output to IDE Monitor
 
+#if DAWS_PERIPHERAL  // accessory services are peripheral only
+
 
 
 const  ReporterType BLEAccService::_type = ACC_REP;
@@ -51,6 +53,25 @@ const char BLEAccService::_idDescTxt[] = "Id";
 const char BLEAccService::_stateDescTxt[] = "State";
 const char BLEAccService::_cmdDescTxt[] = "Command";
 
+// command handle index - sorted on handle
+BLEAccService::CmdEntry_t BLEAccService::_cmdTab[MAX_ACC_SERVICE_COUNT];
+int BLEAccService::_cmdCount = 0;
+bool BLEAccService::_writeCBset = false;
+
+// deferred command queue - written on the BLE thread, read by the command worker
+BLEAccService::CmdQEntry_t BLEAccService::_cmdQ[CMD_QUEUE_SIZE];
+volatile uint16_t BLEAccService::_cmdQHead = 0;
+volatile uint16_t BLEAccService::_cmdQTail = 0;
+rtos::Thread* BLEAccService::_cmdThread = nullptr;
+CmdMetrics_t BLEAccService::_cmdMetrics = {0, 0, 0, 0, 0};
+BLECtlService* BLEAccService::_ctlService = nullptr;
+
+static_assert((CMD_QUEUE_SIZE & (CMD_QUEUE_SIZE - 1)) == 0, "command queue size must be a power of 2");
+static_assert(CMD_QUEUE_SIZE <= 0x8000, "command queue indices are 16 bit");
+static_assert(MAX_ACC_SERVICE_COUNT > 0, "controller needs at least one accessory service");
+static_assert(MAX_ACC_SERVICE_COUNT <= ATT_DEFAULT_NOTIFY_SIZE,
+              "aggregated state would not fit one notification at the default ATT MTU - reduce MAX_ACC_SERVICE_COUNT");
+
 const GattCharacteristic::PresentationFormat_t BLEAccService::_idFormatField =
 { GattCharacteristic::BLE_GATT_FORMAT_UTF8S,
     0,
@@ -149,14 +170,15 @@ _cmdAttributes{&_cmdUserDesc},
 _cmdCharacteristic
 {
         BLEcore::getUUID(CMD_UUID),     // uuid
-        (uint8_t*)&_command,    // command
+        _command,    // command
         sizeof(uint8_t), // size of value
-        sizeof(uint8_t),
+        CMD_VALUE_SIZE,  // command and optional sequence number
         GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_READ |
-        GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_WRITE,
+        GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_WRITE |
+        (CMD_WRITE_NO_RSP?GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_WRITE_WITHOUT_RESPONSE:0),
         _cmdAttributes,  // same attributes as state (i.e. user name
         CMD_ATTRIBUTE_COUNT,
-        false
+        true   // variable length - sequence number is optional
         
 },
 
@@ -176,10 +198,20 @@ GattService(BLEcore::getServUUID(),      // UUID
             3)                      // number of service characteristics
             
 {
+    // server RAM - checked here as the tables are private
+    static_assert(MAX_ACC_SERVICE_COUNT * (sizeof(BLEAccService) + sizeof(CmdEntry_t)) +
+                  CMD_QUEUE_SIZE * sizeof(CmdQEntry_t) + sizeof(BLECtlService) <= DAWS_SVR_RAM_BUDGET,
+                  "server services and tables exceed DAWS_SVR_RAM_BUDGET - reduce the capacities or raise the budget");
     _accId = accId;
     _accIdLen = strlen(accId);
     _idUserDesc.allowWrite(false);
     _state = P_UNKNOWN;             // initial state server side is unknown
+    for (int i = 0; i < MAX_CMD_CLIENTS; i++)
+    {
+        _lastSeq[i].connHandle = NO_CONN_HANDLE;  // no commands yet
+    }
+    _mailState = (uint8_t)P_UNKNOWN;
+    _mailFull = false;
 }
 
 /**
@@ -187,19 +219,26 @@ GattService(BLEcore::getServUUID(),      // UUID
  
  This sets the service up. It
  -  adds the service to the server, and
- -  adds a callback which is executed when data are written.
+ -  adds the command characteristic handle to the write dispatcher.  The dispatcher's callback is added
+ the first time a service is set up.
  */
 void BLEAccService::setup()
 {
     // add this service to the server
     _gattServer.addService(*this);
     
-    // register the write call back routine
-    _gattServer.onDataWritten().add(
-                                    ble::WriteCallback_t(
-                                                         this,
-                                                         &BLEAccService::_dataWritten)
-                                    );
+    // register the write call back routine - once for all services
+    // client connection changes reset the command sequence numbers
+    if (!_writeCBset)
+    {
+        _gattServer.onDataWritten().add(
+                                        ble::WriteCallback_t(
+                                                             &BLEAccService::_onDataWritten)
+                                        );
+        BLEcore::instance().setPeripheralConnCallback(&BLEAccService::_onConnChange);
+        _writeCBset = true;
+    }
+    _addCmdHandle();
 
     vSetup();  // invoke the setup in the derrived class if present
 }
@@ -280,24 +319,54 @@ void BLEAccService::listHandles()
 /**
 @brief post the updated state to the client
  
- This writes the updated state characteristic value which will notify the client as long as it has enabled
+ This posts the updated state characteristic value which will notify the client as long as it has enabled
  notifications for this characteristic.  Usually called as result of a received accessory command.
  A command may generate more
  than one update, e.g on starting and completing a point movement.
  
+ The BLE stack is not reentrant so the state is not written here.  It is left in a mailbox and the
+ write is done on the BLE event queue.  This may be called from any thread or from an interrupt
+ and never blocks.  If the state is updated again before the write is done only the latest state
+ is written.
+ 
  @param newState - the updated state
  
- @return the BLE error code
+ @return the BLE error code - BLE_ERROR_NO_MEM if the write could not be posted to the event queue
  */
 ble_error_t BLEAccService::updateState(PointState_t newState)
+{
+    core_util_atomic_store_u8(&_mailState, (uint8_t)newState);
+    if (!core_util_atomic_exchange_bool(&_mailFull, true))
+    {
+        // mailbox was empty - post the drain.  Otherwise one is already posted and will pick this up
+        if (BLEcore::instance().getEventQueue()->call
+            (
+             mbed::callback(this, &BLEAccService::_drainState)
+             ) == 0)
+        {
+            core_util_atomic_store_bool(&_mailFull, false);  // let the next update try again
+            return(BLE_ERROR_NO_MEM);
+        }
+    }
+    return(BLE_ERROR_NONE);
+}
+
+// write the latest posted state - BLE thread
+void BLEAccService::_drainState()
 {
     ble_error_t bleErr;
-    _state = newState;
+    // empty the mailbox before taking the state so a later update is never lost
+    core_util_atomic_store_bool(&_mailFull, false);
+    _state = (PointState_t)core_util_atomic_load_u8(&_mailState);
     bleErr = _gattServer.write(_stateCharacteristic.getValueHandle(),
                                                 (const uint8_t*)&_state,
                                                 (uint16_t)sizeof(_state),
                                                 false);
-    queueReport(ACC_STATE_CHANGE, newState);
+    queueReport(ACC_STATE_CHANGE, _state);
+    if (_ctlService != nullptr)
+    {
+        _ctlService->stateChanged();
+    }
 #if DEBUG
     if (bleErr != BLE_ERROR_NONE)
     {
@@ -305,13 +374,321 @@ ble_error_t BLEAccService::updateState(PointState_t newState)
         Serial.println(bleErr);
     }
 #endif
-    return(bleErr);
+    (void)bleErr;
+}
+
+/**
+ @brief Expose the state
+ 
+ @return the state as last written to the state characteristic
+ */
+PointState_t BLEAccService::getState()
+{
+    return(_state);
+}
+
+/**
+ @brief Get the number of accessory services set up
+ 
+ @return the number of accessory services in the write dispatcher
+ */
+int BLEAccService::getServiceCount()
+{
+    return(_cmdCount);
+}
+
+/**
+ @brief Get an accessory service
+ 
+ The services are in handle order, i.e. the order they were added to the server.
+ 
+ @param i - index of the service
+ 
+ @return pointer to the service
+ */
+BLEAccService* BLEAccService::getService(int i)
+{
+    return(_cmdTab[i].service);
+}
+
+/**
+ @brief Set the controller service
+ 
+ State changes are passed to the controller service once it's set up.
+ 
+ @param ctl - the controller service
+ */
+void BLEAccService::setCtlService(BLECtlService* ctl)
+{
+    _ctlService = ctl;
+}
+
+/*
+ ********************************************************
+ 
+ Accessory controller service
+ 
+ ********************************************************
+ */
+
+/**
+ @brief BLE Accessory Controller Service Constructor
+ 
+ This constructs the controller service and its aggregated state and route command characteristics.
+ */
+BLECtlService::BLECtlService() :
+
+// build aggregated state characteristic
+_aggStateCharacteristic
+{
+        BLEcore::getUUID(AGG_STATE_UUID),     // uuid
+        _aggState,    // value
+        0, // no accessories yet
+        MAX_ACC_SERVICE_COUNT,
+        GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_READ |
+        GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_NOTIFY,
+        nullptr,
+        0,
+        true   // variable length - one byte per accessory
+},
+
+// build route command characteristic
+_routeCharacteristic
+{
+        BLEcore::getUUID(ROUTE_UUID),     // uuid
+        _routeRx,    // value
+        0,
+        ROUTE_SIZE(MAX_ROUTE_STEPS),
+        GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_WRITE,
+        nullptr,
+        0,
+        true   // variable length - count and steps
+},
+
+// build array of characteristics
+_ctlCharacteristics{
+    &_aggStateCharacteristic,
+    &_routeCharacteristic,
+},
+
+// and finally the service
+GattService(BLEcore::getCtlServUUID(),      // UUID
+            _ctlCharacteristics,// list of service characteristics
+            CTL_CHARACTERISTIC_COUNT)       // number of service characteristics
+{
+    _flushPending = false;
+    _routeLen = 0;
+}
+
+/**
+ @brief Setup the controller service
+ 
+ This adds the service to the server and sets the initial aggregated state.  It must be called after the
+ accessory services have been set up.
+ */
+void BLECtlService::setup()
+{
+    _gattServer.addService(*this);
+    BLEAccService::setCtlService(this);
+    _flush();
+}
+
+/**
+ @brief Accessory state changed
+ 
+ Called on the BLE thread when an accessory state has been written.  The aggregated state write is posted
+ to the BLE event queue so all the state changes already posted are included in one write.
+ */
+void BLECtlService::stateChanged()
+{
+    if (!_flushPending)
+    {
+        _flushPending = (BLEcore::instance().getEventQueue()->call
+                         (
+                          mbed::callback(this, &BLECtlService::_flush)
+                          ) != 0);
+    }
+}
+
+/**
+ @brief Data written callback
+ 
+ Called by the accessory service write dispatcher for writes to handles that are not accessory commands.  A route
+ longer than the ATT MTU arrives as a prepared (long) write and may be passed here in fragments, so the route is
+ assembled by offset and applied once all the steps given by the count have arrived.
+ 
+ @param cbp - the write callback parameters
+ */
+void BLECtlService::dataWritten(const GattWriteCallbackParams* cbp)
+{
+    if (cbp->handle != _routeCharacteristic.getValueHandle())
+    {
+        return;  // not ours
+    }
+    if ((cbp->offset + cbp->len) > sizeof(_routeRx))
+    {
+        _routeLen = 0;  // too long - discard
+        return;
+    }
+    if (cbp->offset == 0)
+    {
+        _routeLen = 0;  // start of a new route
+    }
+    memcpy(&_routeRx[cbp->offset], cbp->data, cbp->len);
+    if ((cbp->offset + cbp->len) > _routeLen)
+    {
+        _routeLen = cbp->offset + cbp->len;
+    }
+    if ((_routeLen > 0) && (_routeLen >= ROUTE_SIZE(_routeRx[0])))
+    {
+        _applyRoute(cbp->connHandle);
+        _routeLen = 0;
+    }
+}
+
+// apply a complete route as a unit
+// all the steps are checked first - if any is for an unknown accessory, or the command queue
+// can't take them all, none are applied
+// otherwise all the commands are executed, or queued before the worker is woken
+void BLECtlService::_applyRoute(ble::connection_handle_t ch)
+{
+    uint8_t count = _routeRx[0];
+    const uint8_t* step;
+    
+    if (count > MAX_ROUTE_STEPS)
+    {
+        return;
+    }
+    for (uint8_t i = 0; i < count; i++)
+    {
+        step = &_routeRx[ROUTE_SIZE(i)];
+        if (BLEAccService::_findByCmdHandle(step[0] | (step[1] << 8)) == nullptr)
+        {
+#if DEBUG
+            Serial.println("Route rejected - unknown accessory");
+#endif
+            return;
+        }
+    }
+    if (!BLEAccService::_reserveCommands(count))
+    {
+#if DEBUG
+        Serial.println("Route rejected - command queue full");
+#endif
+        return;
+    }
+    for (uint8_t i = 0; i < count; i++)
+    {
+        step = &_routeRx[ROUTE_SIZE(i)];
+        BLEAccService::_findByCmdHandle(step[0] | (step[1] << 8))->_execCommand(step[2], ch);
+    }
+    BLEAccService::_signalWorker();
+}
+
+// write the aggregated state - BLE thread
+void BLECtlService::_flush()
+{
+    ble_error_t bleErr;
+    int count = BLEAccService::getServiceCount();
+    
+    _flushPending = false;
+    for (int i = 0; i < count; i++)
+    {
+        _aggState[i] = (uint8_t)BLEAccService::getService(i)->getState();
+    }
+    bleErr = _gattServer.write(_aggStateCharacteristic.getValueHandle(),
+                               _aggState,
+                               (uint16_t)count,
+                               false);
+#if DEBUG
+    if (bleErr != BLE_ERROR_NONE)
+    {
+        Serial.print("Aggregated state write error ");
+        Serial.println(bleErr);
+    }
+#endif
+    (void)bleErr;
+}
+
+/*
+ ********************************************************
+ 
+ Write dispatcher
+ 
+ There is a single data written callback for all accessory services.  The command characteristic
+ value handles are held in a table sorted on handle so a client write is passed to the right service
+ by a binary search.  Handles are allocated when the service is added to the server so the
+ table is filled by setup.
+ 
+ ********************************************************
+ */
+
+// add this service's command handle to the table keeping it in order
+void BLEAccService::_addCmdHandle()
+{
+    GattAttribute::Handle_t h = _cmdCharacteristic.getValueHandle();
+    int pos = _cmdCount;
+    
+    if (_cmdCount >= MAX_ACC_SERVICE_COUNT)
+    {
+#if DEBUG
+        Serial.println("Too many accessory services for write dispatcher");
+#endif
+        return;
+    }
+    while ((pos > 0) && (_cmdTab[pos - 1].handle > h))
+    {
+        _cmdTab[pos] = _cmdTab[pos - 1];
+        pos--;
+    }
+    _cmdTab[pos].handle = h;
+    _cmdTab[pos].service = this;
+    _cmdCount++;
+}
+
+// find the service with the given command handle - nullptr if none
+BLEAccService* BLEAccService::_findByCmdHandle(GattAttribute::Handle_t h)
+{
+    int lo = 0;
+    int hi = _cmdCount - 1;
+    int mid;
+    
+    while (lo <= hi)
+    {
+        mid = (lo + hi) / 2;
+        if (_cmdTab[mid].handle == h)
+        {
+            return(_cmdTab[mid].service);
+        }
+        else if (_cmdTab[mid].handle < h)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+    return(nullptr);
+}
+
+// data written callback for all services - find the service by handle
+void BLEAccService::_onDataWritten(const GattWriteCallbackParams* cbp)
+{
+    BLEAccService* service = _findByCmdHandle(cbp->handle);
+    if (service != nullptr)
+    {
+        service->_dataWritten(cbp);
+    }
+    else if (_ctlService != nullptr)
+    {
+        // may be for the controller service
+        _ctlService->dataWritten(cbp);
+    }
 }
 
-// Data written function for callback. Called back when the client
-// has written (to any characteristic value on any service).
-// We need to check that the handle
-// relates to this service.
+// Data written function for the service.  Called back by the dispatcher
+// when the client has written to this service's command characteristic.
 
 void BLEAccService::_dataWritten(const GattWriteCallbackParams* cbp)
 {
@@ -333,13 +710,220 @@ void BLEAccService::_dataWritten(const GattWriteCallbackParams* cbp)
     }
     Serial.println();
 #endif
-    if ((_cmdCharacteristic.getValueHandle() == cbp->handle) &&
-        (cbp->len == 1))
+    if (_cmdCharacteristic.getValueHandle() != cbp->handle)
+    {
+        return;
+    }
+    if (cbp->len == 1)
     {
         // it's our command characteristic handle and a single character
-        doCommand(*(cbp->data));  // call command processor in inheriting class
+        _execCommand(*(cbp->data), cbp->connHandle);
+        _signalWorker();
+    }
+    else if (cbp->len == CMD_VALUE_SIZE)
+    {
+        // command and sequence number - usually a write without response
+        // the client may repeat a command if it doesn't see the state change, so
+        // a repeat of that client's last sequence number is discarded
+        if (!_newSeq(cbp->connHandle, cbp->data[1]))
+        {
+#if DEBUG
+            Serial.println("Duplicate command discarded");
+#endif
+            return;
+        }
+        _execCommand(cbp->data[0], cbp->connHandle);
+        _signalWorker();
+    }
+}
+
+// check the sequence number is not a repeat of the last from the client connection and record it
+// if there's no room to record it the command is taken as new
+bool BLEAccService::_newSeq(ble::connection_handle_t ch, uint8_t seq)
+{
+    int free = -1;
+    
+    for (int i = 0; i < MAX_CMD_CLIENTS; i++)
+    {
+        if (_lastSeq[i].connHandle == ch)
+        {
+            if (_lastSeq[i].seq == seq)
+            {
+                return(false);
+            }
+            _lastSeq[i].seq = seq;
+            return(true);
+        }
+        if ((free < 0) && (_lastSeq[i].connHandle == NO_CONN_HANDLE))
+        {
+            free = i;
+        }
+    }
+    if (free >= 0)
+    {
+        _lastSeq[free].connHandle = ch;
+        _lastSeq[free].seq = seq;
     }
+    return(true);
 }
 
+// a client connection has opened or closed - forget its sequence numbers in all services
+void BLEAccService::_onConnChange(const ble::connection_handle_t ch)
+{
+    for (int i = 0; i < _cmdCount; i++)
+    {
+        BLEAccService* service = _cmdTab[i].service;
+        for (int j = 0; j < MAX_CMD_CLIENTS; j++)
+        {
+            if (service->_lastSeq[j].connHandle == ch)
+            {
+                service->_lastSeq[j].connHandle = NO_CONN_HANDLE;
+            }
+        }
+    }
+}
+
+// execute a command now or queue it for the worker
+// the worker is not signalled so several commands can be queued as a unit
+void BLEAccService::_execCommand(uint8_t cmd, ble::connection_handle_t ch)
+{
+    if (_cmdThread == nullptr)
+    {
+        // no worker - call command processor in inheriting class here and now
+        _cmdMetrics.received++;
+        _cmdMetrics.executed++;
+        doCommand(cmd);
+    }
+    else
+    {
+        _pushCommand(cmd, ch);
+    }
+}
+
+// wake the worker if there are commands queued
+void BLEAccService::_signalWorker()
+{
+    if ((_cmdThread != nullptr) &&
+        (_cmdQHead != core_util_atomic_load_u16(&_cmdQTail)))
+    {
+        _cmdThread->flags_set(CMD_QUEUE_FLAG);
+    }
+}
+
+/*
+ ********************************************************
+ 
+ Deferred command execution
+ 
+ By default commands are executed in the write callback on the BLE thread.  A slow accessory driver
+ then holds up all other BLE processing.  If the command worker is started, received commands are
+ queued and executed on the worker thread instead.
+ 
+ The queue is a bounded single producer (BLE thread), single consumer (worker) ring.  The head is only
+ written by the producer and the tail only by the consumer, so no lock is needed.  If the queue is full
+ the command is dropped and counted - the client sees the state doesn't change.
+ 
+ ********************************************************
+ */
+
+/**
+ @brief Start the command worker thread
+ 
+ Once started, commands written by clients are executed on the worker thread rather than in the BLE
+ write callback.  Call once, after the services have been set up.  Further calls are ignored.
+ 
+ @param priority - worker thread priority
+ @param stackSize - worker thread stack size in bytes
+ */
+void BLEAccService::startCommandWorker(osPriority priority, uint32_t stackSize)
+{
+    if (_cmdThread != nullptr)
+    {
+        return;  // already running
+    }
+    // created on the heap but never deleted
+    _cmdThread = new rtos::Thread(priority, stackSize, nullptr, "dawsCmd");
+    _cmdThread->start(mbed::callback(&BLEAccService::_cmdWorker));
+}
+
+/**
+ @brief Get the command metrics
+ 
+ Counts, peak queue depth and the time from command receipt to execution for deferred commands.
+ 
+ @param metrics - the structure to be filled in
+ */
+void BLEAccService::getCommandMetrics(CmdMetrics_t& metrics)
+{
+    metrics = _cmdMetrics;
+}
 
+// queue a received command for the worker - BLE thread only
+void BLEAccService::_pushCommand(uint8_t cmd, ble::connection_handle_t ch)
+{
+    uint16_t head = _cmdQHead;
+    uint16_t depth = (uint16_t)(head - core_util_atomic_load_u16(&_cmdQTail));
+    CmdQEntry_t& entry = _cmdQ[head & (CMD_QUEUE_SIZE - 1)];
+    
+    _cmdMetrics.received++;
+    if (depth >= CMD_QUEUE_SIZE)
+    {
+        _cmdMetrics.dropped++;
+#if DEBUG
+        Serial.println("Command queue full - command dropped");
+#endif
+        return;
+    }
+    entry.service = this;
+    entry.cmd = cmd;
+    entry.connHandle = ch;
+    entry.rxTime = micros();
+    core_util_atomic_store_u16(&_cmdQHead, head + 1);  // publish the entry
+    if (depth + 1 > _cmdMetrics.maxDepth)
+    {
+        _cmdMetrics.maxDepth = depth + 1;
+    }
+}
+
+// check the queue has room for a group of commands - BLE thread only
+// as the BLE thread is the only producer the room can only grow until they are pushed
+// if not, the whole group is counted as received and dropped
+bool BLEAccService::_reserveCommands(uint8_t count)
+{
+    if ((_cmdThread == nullptr) ||
+        ((uint16_t)(_cmdQHead - core_util_atomic_load_u16(&_cmdQTail)) + count <= CMD_QUEUE_SIZE))
+    {
+        return(true);
+    }
+    _cmdMetrics.received += count;
+    _cmdMetrics.dropped += count;
+    return(false);
+}
+
+// command worker thread - execute queued commands in order
+void BLEAccService::_cmdWorker()
+{
+    uint16_t tail;
+    uint32_t latency;
+    
+    while (true)
+    {
+        rtos::ThisThread::flags_wait_any(CMD_QUEUE_FLAG);
+        tail = _cmdQTail;
+        while (tail != core_util_atomic_load_u16(&_cmdQHead))
+        {
+            CmdQEntry_t& entry = _cmdQ[tail & (CMD_QUEUE_SIZE - 1)];
+            latency = micros() - entry.rxTime;
+            if (latency > _cmdMetrics.maxLatencyUs)
+            {
+                _cmdMetrics.maxLatencyUs = latency;
+            }
+            entry.service->doCommand(entry.cmd);  // call command processor in inheriting class
+            _cmdMetrics.executed++;
+            tail++;
+            core_util_atomic_store_u16(&_cmdQTail, tail);  // release the entry
+        }
+    }
+}
 
+#endif /* DAWS_PERIPHERAL */
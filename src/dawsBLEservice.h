@@ -32,6 +32,29 @@
 #define STATE_ATTRIBUTE_COUNT 1 ///< number of attributes in state characteristic
 #define CMD_ATTRIBUTE_COUNT 1 ///< number of attributes in command characteristic
 #define MAX_ACC_CHARACTERISTIC_COUNT 3  ///< id, command and state
+// capacities are set in dawsConfig.h
+#define CMD_QUEUE_FLAG 0x01  ///< command worker thread flag - commands queued
+#define CMD_WORKER_STACK 2048  ///< default command worker stack size
+#define CMD_VALUE_SIZE 2  ///< command characteristic value - command and optional sequence number
+#define CMD_WRITE_NO_RSP true  ///< command characteristic accepts write without response
+#define CTL_CHARACTERISTIC_COUNT 2  ///< aggregated state and route command
+
+class BLECtlService;
+
+/**
+ @brief Deferred command metrics
+ 
+ Counts and timings for commands received by accessory services.  Latency is from receipt in the BLE write callback
+ to the start of execution on the command worker thread.
+ */
+struct CmdMetrics_t
+{
+    uint32_t received;      ///< commands received
+    uint32_t executed;      ///< commands executed
+    uint32_t dropped;       ///< commands dropped because the queue was full
+    uint32_t maxDepth;      ///< peak queue depth
+    uint32_t maxLatencyUs;  ///< peak time from receipt to execution (us)
+};
 
 
 
@@ -48,6 +71,11 @@
  
  - a status characteristic, used by the server to notify the client.
  
+ The command value is the command, optionally followed by a sequence number.  A client sending the sequence number
+ may use write without response and repeat a command it doesn't see acknowledged by a state change.
+ Repeats are discarded.  Sequence numbers are kept per client connection and forgotten when the connection
+ opens or closes.
+ 
  This defines the service on the server (usually peripheral) side.  At the client the service and its characteristics are discovered.
  
  
@@ -78,13 +106,33 @@ public:
     virtual void vSetup();
     ble_error_t updateState(PointState_t);
     void listHandles();
+    
+    static void startCommandWorker(osPriority = osPriorityNormal, uint32_t = CMD_WORKER_STACK);
+    static void getCommandMetrics(CmdMetrics_t&);
+    
+    PointState_t getState();
+    static int getServiceCount();
+    static BLEAccService* getService(int);
+    static void setCtlService(BLECtlService*);
 
 private:
     static const ReporterType _type; // reporter type
     ble::GattServer& _gattServer = BLE::Instance().gattServer();  // reference gattServer
 
     PointState_t _state;        // value for the state characteristic
-    uint8_t _command;           // value for the command characteristic
+    volatile uint8_t _mailState;  // latest state posted by updateState
+    volatile bool _mailFull;      // set when a state is posted and the drain not yet run
+    void _drainState();
+    uint8_t _command[CMD_VALUE_SIZE];  // value for the command characteristic
+    // sequence number of the last command from each client connection - repeats are discarded
+    struct CmdSeq_t
+    {
+        ble::connection_handle_t connHandle;  // client connection - NO_CONN_HANDLE if entry free
+        uint8_t seq;                          // last sequence number
+    };
+    CmdSeq_t _lastSeq[MAX_CMD_CLIENTS];
+    bool _newSeq(ble::connection_handle_t, uint8_t);
+    static void _onConnChange(const ble::connection_handle_t);
     
     // characterisitics
     GattCharacteristic _stateCharacteristic;  // state characteristic
@@ -116,7 +164,87 @@ private:
     
 
     void _dataWritten(const GattWriteCallbackParams*);
+    
+    // write dispatcher - command handle to service, sorted on handle
+    struct CmdEntry_t
+    {
+        GattAttribute::Handle_t handle;  // command characteristic value handle
+        BLEAccService* service;          // owning service
+    };
+    static CmdEntry_t _cmdTab[];
+    static int _cmdCount;
+    static bool _writeCBset;  // set once the dispatcher callback is registered
+    void _addCmdHandle();
+    static void _onDataWritten(const GattWriteCallbackParams*);
+    
+    // deferred command queue - single producer (BLE thread), single consumer (worker)
+    struct CmdQEntry_t
+    {
+        BLEAccService* service;          // service the command was written to
+        uint8_t cmd;                     // command character
+        ble::connection_handle_t connHandle;  // client connection
+        uint32_t rxTime;                 // time received (us)
+    };
+    static CmdQEntry_t _cmdQ[];
+    static volatile uint16_t _cmdQHead;   // next entry to be written - producer only
+    static volatile uint16_t _cmdQTail;   // next entry to be executed - consumer only
+    static rtos::Thread* _cmdThread;      // command worker - nullptr if commands are executed inline
+    static CmdMetrics_t _cmdMetrics;
+    void _pushCommand(uint8_t, ble::connection_handle_t);
+    static void _cmdWorker();
+    
+    static BLECtlService* _ctlService;   // controller service - nullptr if not in use
+    
+    void _execCommand(uint8_t, ble::connection_handle_t);
+    static void _signalWorker();
+    static bool _reserveCommands(uint8_t);
+    static BLEAccService* _findByCmdHandle(GattAttribute::Handle_t);
+    friend class BLECtlService;  // applies routes through the command path
  
 };
 
+/**
+ @brief BLE Accessory Controller Service
+ 
+ This optional service covers all the accessory services on a controller.  There is at most one instance.
+ 
+ It has an aggregated state characteristic.  The value holds the state of each accessory service, one byte each,
+ in the order the accessory services were added to the server (i.e. in handle order).  When any accessory state
+ changes the aggregated value is written once, after all the state changes posted at the time have been written, so a
+ client that subscribes to it gets one notification rather than one per accessory.  A reconnecting client can read all
+ the states in one read.
+ 
+ It also has a route command characteristic.  A route is a step count followed by that many steps, each the
+ accessory's command characteristic value handle (LSB first) and the command.  The steps are applied as a unit.
+ 
+ It must be set up after the accessory services.
+ 
+ @see BLEAccService
+ *********************************/
+
+class BLECtlService: public GattService
+{
+public:
+    BLECtlService();
+    void setup();
+    void stateChanged();
+    void dataWritten(const GattWriteCallbackParams*);
+    
+private:
+    ble::GattServer& _gattServer = BLE::Instance().gattServer();  // reference gattServer
+    
+    uint8_t _aggState[MAX_ACC_SERVICE_COUNT];  // value for the aggregated state characteristic
+    bool _flushPending;                        // aggregated state write posted
+    
+    uint8_t _routeRx[ROUTE_SIZE(MAX_ROUTE_STEPS)];  // route as received
+    uint16_t _routeLen;                           // route bytes received so far
+    
+    GattCharacteristic _aggStateCharacteristic;  // aggregated state characteristic
+    GattCharacteristic _routeCharacteristic;     // route command characteristic
+    GattCharacteristic* _ctlCharacteristics[CTL_CHARACTERISTIC_COUNT];
+    
+    void _flush();
+    void _applyRoute(ble::connection_handle_t);
+};
+
 #endif /* defined(____dawsBLEservice__) */
@@ -0,0 +1,130 @@
+/**
+@file dawsConfig.h
+@author Paul Redhead on 3/2/2021.
+@copyright (C) 2021 Paul Redhead
+ */
+
+//
+//  This file is part of DAWS.
+//  DAWS is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  DAWS is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+
+//  You should have received a copy of the GNU General Public License
+//  along with DAWS.  If not, see <http://www.gnu.org/licenses/>.
+//
+//  Version 0.a First released version
+//
+//
+//
+
+#ifndef ____dawsConfig__
+#define ____dawsConfig__
+
+/*
+ ********************************************************
+ Build configuration
+ 
+ The capacities and the role size the library's classes and tables, so the library sources and the sketch
+ must all see the same values.  They are all held here and this is included by dawsBLE.h.  Change them by editing
+ this file, or by setting them for the whole build (e.g. as -D compiler flags, plain numbers).  A #define in the
+ sketch doesn't reach the library sources, so don't set them there.
+ 
+ A mismatch is caught at link time - the library defines a symbol named from the values and every file including
+ this one refers to the symbol named from the values it sees.
+ ********************************************************
+ */
+
+// build role - selects the code built.  A peripheral (accessory controller) never scans or acts as a GATT client,
+// a central (e.g. loco) never advertises or provides services
+#define DAWS_ROLE_PERIPHERAL 1 ///< advertising and accessory services
+#define DAWS_ROLE_CENTRAL 2    ///< scanning, connecting and accessory clients
+#define DAWS_ROLE_DUAL 3       ///< both
+#ifndef DAWS_BLE_ROLE
+#define DAWS_BLE_ROLE DAWS_ROLE_DUAL ///< role built
+#endif
+#define DAWS_PERIPHERAL ((DAWS_BLE_ROLE & DAWS_ROLE_PERIPHERAL) != 0) ///< peripheral code is built
+#define DAWS_CENTRAL ((DAWS_BLE_ROLE & DAWS_ROLE_CENTRAL) != 0) ///< central code is built
+
+#ifndef DAWS_STRING_API
+#define DAWS_STRING_API true ///< keep the Arduino String overloads of the name and id functions for existing sketches
+#endif
+
+// capacities - common
+#ifndef MAX_ID_SIZE
+#define MAX_ID_SIZE 10 ///< maximum size for identifier strings
+#endif
+#ifndef MAX_ROUTE_STEPS
+#define MAX_ROUTE_STEPS 16 ///< maximum number of points set by one route command
+#endif
+
+// capacities - central
+#ifndef MAX_PENDING_CON
+#define MAX_PENDING_CON 4 ///< number of central connects that may be awaiting completion
+#endif
+#ifndef MAX_CONN_OWNER
+#define MAX_CONN_OWNER 8  ///< number of open connections that may have an owner
+#endif
+#ifndef MAX_DISCOVERED_ACCESSORY
+#define MAX_DISCOVERED_ACCESSORY 4 ///< number of discovered accessories per connection
+#endif
+#ifndef MAX_REMOTE_CON
+#define MAX_REMOTE_CON 5 ///< number of remote connections
+#endif
+#ifndef MAX_PEER_COUNT
+#define MAX_PEER_COUNT 24 ///< number of peers that may be found by scanning
+#endif
+#ifndef PEER_TABLE_SIZE
+#define PEER_TABLE_SIZE 32 ///< peer table slots - a power of 2 and larger than MAX_PEER_COUNT
+#endif
+#ifndef MAX_NAME_SIZE
+#define MAX_NAME_SIZE 30 ///< maximum size for peer local names including terminator
+#endif
+#ifndef ID_TABLE_SIZE
+#define ID_TABLE_SIZE 64 ///< remote accessory id index slots - a power of 2 and larger than the number of accessories
+#endif
+#ifndef DAWS_CLI_RAM_BUDGET
+#define DAWS_CLI_RAM_BUDGET 16384 ///< limit on the client's static tables - connections, peers and accessory pool
+#endif
+
+// capacities - peripheral
+#ifndef MAX_ACC_SERVICE_COUNT
+#define MAX_ACC_SERVICE_COUNT 16  ///< maximum number of accessory services on a controller
+#endif
+#ifndef CMD_QUEUE_SIZE
+#define CMD_QUEUE_SIZE 8  ///< deferred command queue size - a power of 2
+#endif
+#ifndef MAX_CMD_CLIENTS
+#define MAX_CMD_CLIENTS 4  ///< client connections whose command sequence numbers are tracked per service
+#endif
+#ifndef DAWS_SVR_RAM_BUDGET
+#define DAWS_SVR_RAM_BUDGET 16384 ///< limit on the server's services and tables - accessory and controller services and command queue
+#endif
+
+// configuration check symbol - named from every value that changes a class layout
+#define DAWS_SIG_(r, a, b, c, d, e, f, g, h, i, j, k, l, m) \
+    dawsConfig_##r##_##a##_##b##_##c##_##d##_##e##_##f##_##g##_##h##_##i##_##j##_##k##_##l##_##m
+#define DAWS_SIG(...) DAWS_SIG_(__VA_ARGS__)
+#define DAWS_CONFIG_SIG DAWS_SIG(DAWS_BLE_ROLE, MAX_ID_SIZE, MAX_ROUTE_STEPS, MAX_PENDING_CON, MAX_CONN_OWNER, \
+    MAX_DISCOVERED_ACCESSORY, MAX_REMOTE_CON, MAX_PEER_COUNT, PEER_TABLE_SIZE, MAX_NAME_SIZE, ID_TABLE_SIZE, \
+    MAX_ACC_SERVICE_COUNT, CMD_QUEUE_SIZE, MAX_CMD_CLIENTS) ///< configuration check symbol
+
+extern const uint8_t DAWS_CONFIG_SIG;  // defined in dawsBLE.cpp
+
+// refer to the library's symbol - an undefined reference to dawsConfig_... means the configuration differs
+// from the library's.  The reference is from a static constructor so it survives unused section removal
+static struct DawsConfigCheck_t
+{
+    DawsConfigCheck_t()
+    {
+        (void)*(const volatile uint8_t*)&DAWS_CONFIG_SIG;
+    }
+} dawsConfigCheck;
+
+#endif /* defined(____dawsConfig__) */
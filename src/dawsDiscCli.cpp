@@ -49,9 +49,16 @@
 
 #define DEBUG false  ///< enable BLE debug output to IDE Monitor
 
+#if DAWS_CENTRAL  // accessory clients are central only
+
 
 const ReporterType DiscoveredAccCli::_type = RA_REP;
 
+// handle index - sorted on connection and attribute handle
+DiscoveredAccCli::HandleEntry_t DiscoveredAccCli::_handleTab[MAX_CLI_HANDLES];
+int DiscoveredAccCli::_handleCount = 0;
+bool DiscoveredAccCli::_hvxSet = false;
+
 /**
  @brief Construct a discovered accessory
  
@@ -60,19 +67,30 @@ const ReporterType DiscoveredAccCli::_type = RA_REP;
  */
 DiscoveredAccCli::DiscoveredAccCli() :Reporter(RA_REP)
 {
-    _serviceUUID = BLE_UUID_UNKNOWN;  // initially unknown until discovery undertaken
+    _connHandle = NO_CONN_HANDLE;
+    _remDev = nullptr;
+    _nextOnConn = nullptr;
+    _cmdNoRsp = false;
+    _cmdSeq = 0;
+    _idHandle = _stateHandle = _cmdHandle = GattAttribute::INVALID_HANDLE;
+    _stateCCCDHandle = GattAttribute::INVALID_HANDLE;
 }
 /**
  @brief Construct a discovered accessory with data
  
- This constructs the discovered accessory client with connection handle and UUID.  Further detail is added during the discovery process.
+ This constructs the discovered accessory client with connection handle.  Further detail is added during the discovery process.
  
  */
 
-DiscoveredAccCli::DiscoveredAccCli(ble::connection_handle_t ch, UUID uuid): Reporter(RA_REP)
+DiscoveredAccCli::DiscoveredAccCli(ble::connection_handle_t ch): Reporter(RA_REP)
 {
     _connHandle = ch;
-    _serviceUUID = uuid;
+    _remDev = nullptr;
+    _nextOnConn = nullptr;
+    _cmdNoRsp = false;
+    _cmdSeq = 0;
+    _idHandle = _stateHandle = _cmdHandle = GattAttribute::INVALID_HANDLE;
+    _stateCCCDHandle = GattAttribute::INVALID_HANDLE;
 }
 
 
@@ -80,19 +98,94 @@ DiscoveredAccCli::DiscoveredAccCli(ble::connection_handle_t ch, UUID uuid): Repo
 /**
  @brief Initialise the discovered service
  
- This adds information obtained as part of the discovery service to the discovered accessory server and sets
- the callback to be used when the server notifies a change of state
+ This sets the connection handle for a newly discovered accessory service.  Any handles
+ from earlier use of the accessory are cleared so that it can be reused for a newly discovered service.
  
  @param ch - the connection handle for the peripheral remote device providing the service
- @param uuid - the service UUID
  
  */
 
-void DiscoveredAccCli::initSvr(ble::connection_handle_t ch, UUID uuid)
+void DiscoveredAccCli::initSvr(ble::connection_handle_t ch)
 {
     _connHandle = ch;
-    _serviceUUID = uuid;
+    _cmdNoRsp = false;
+    _idHandle = _stateHandle = _cmdHandle = GattAttribute::INVALID_HANDLE;
+    _stateCCCDHandle = GattAttribute::INVALID_HANDLE;
+    _index();
+}
+
+/**
+ @brief Restore handles
+ 
+ This sets up the discovered accessory from handles saved in the handle cache, rather than by discovery.  As
+ there is no initial connect for a restored accessory, the notification callback is set up here.
+ 
+ @param idH - id characteristic value handle
+ @param stateH - state characteristic value handle
+ @param cmdH - command characteristic value handle
+ @param cccdH - state characteristic CCCD handle
+ @param cmdNoRsp - true if the command characteristic allows write without response
+ */
+void DiscoveredAccCli::restoreHandles(GattAttribute::Handle_t idH, GattAttribute::Handle_t stateH,
+                                      GattAttribute::Handle_t cmdH, GattAttribute::Handle_t cccdH,
+                                      bool cmdNoRsp)
+{
+    _idHandle = idH;
+    _stateHandle = stateH;
+    _cmdHandle = cmdH;
+    _stateCCCDHandle = cccdH;
+    _cmdNoRsp = cmdNoRsp;
+    _setHVX();
+    _index();
+}
+
+/**
+ @brief Set the owning connection
+ 
+ This associates the discovered accessory with the remote device connection that found it and sets the
+ connection handle.  It is called when the accessory is discovered and again each time the remote device
+ reconnects (the handle may change) or disconnects (the handle is set to NO_CONN_HANDLE).
+ 
+ @param remDev - the owning remote device connection
+ @param ch - the connection handle
+ */
+void DiscoveredAccCli::setConnection(BLERemDev* remDev, ble::connection_handle_t ch)
+{
+    _remDev = remDev;
+    _connHandle = ch;
+    _index();
+}
+
+/**
+ @brief Expose the owning connection
+ 
+ @return pointer to the remote device connection that owns this accessory
+ */
+BLERemDev* DiscoveredAccCli::getConnection()
+{
+    return(_remDev);
+}
 
+/**
+ @brief Expose the next accessory on the owning connection
+ 
+ Each remote device connection keeps a list of its own accessories linked through the accessories.
+ 
+ @return pointer to the next accessory on the same connection or nullptr if this is the last
+ */
+DiscoveredAccCli* DiscoveredAccCli::getNextOnConn()
+{
+    return(_nextOnConn);
+}
+
+/**
+ @brief Link the next accessory on the owning connection
+ 
+ @param dac - the next accessory on the same connection or nullptr
+ */
+void DiscoveredAccCli::setNextOnConn(DiscoveredAccCli* dac)
+{
+    _nextOnConn = dac;
 }
 
 /**
@@ -109,68 +202,157 @@ ReporterType DiscoveredAccCli::getType()
 }
 
 
-/**
- @brief Initialise Characteristics.
- 
- This has two parts - reading the Accessory ID from the server and informing the service
- that we require notifications for state changes (updating the CCCD).
- 
- If the remote device has already been discovered and we are reconnecting there is no
- need to read the ID again, but the CCCD still has to be updated.
+// set up the notification callback
+// there is one dispatcher for all discovered accessories, set up the first time a state
+// characteristic becomes known.
+// no need to repeat on reconnection - should still be there!
+void DiscoveredAccCli::_setHVX()
+{
+    if (!_hvxSet)
+    {
+        BLE::Instance().gattClient().onHVX
+        ().add
+        (
+         GattClient::HVXCallback_t(&DiscoveredAccCli::_onHVX)
+         );
+        _hvxSet = true;
+    }
+}
+
+/*
+ ********************************************************
  
- This routine initiates the actions required.  Call backs are used for action completion.
+ Handle index
  
- @param connState - the connection state - if initial connect the ID read will be performed
+ Each discovered accessory's state, command and CCCD handles are held in a table sorted on connection
+ and attribute handle so notifications and write responses can be passed to the accessory by a binary
+ search.  An accessory's entries are replaced whenever its connection handle or attribute handles change
+ and removed when it is disconnected.
  
- @return true if actions initiated OK, false if error
+ ********************************************************
  */
-bool DiscoveredAccCli::initCharacteristics(RemDevState_t connState)
+
+// combined sort key
+static inline uint32_t handleKey(ble::connection_handle_t ch, GattAttribute::Handle_t h)
 {
-    ble_error_t bleErr;
+    return(((uint32_t)ch << 16) | h);
+}
 
-    if (connState == CS_CON_INIT)
+// find the first entry with a key not less than that given
+int DiscoveredAccCli::_lowerBound(uint32_t key)
+{
+    int lo = 0;
+    int hi = _handleCount;
+    int mid;
+    
+    while (lo < hi)
     {
-        // set up callback links for initial connection
-        // no need to repeat on reconnection - should still be there!
-        // first - callback to discovered accessory on notification
-        _gattClient.onHVX
-        ().add
-        (
-         GattClient::HVXCallback_t(this, &DiscoveredAccCli::_dataChange)
-         );
+        mid = (lo + hi) / 2;
+        if (_handleTab[mid].key < key)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return(lo);
+}
 
-        // initiate id read for next discovered accessory
-        bleErr = _idDC.read();
+// add an entry keeping the table in order
+void DiscoveredAccCli::_addHandle(GattAttribute::Handle_t h)
+{
+    int pos;
+    uint32_t key = handleKey(_connHandle, h);
+    
+    if (h == GattAttribute::INVALID_HANDLE)
+    {
+        return;
+    }
+    if (_handleCount >= MAX_CLI_HANDLES)
+    {
 #if DEBUG
-        if (bleErr != BLE_ERROR_NONE)
+        Serial.println("Handle index full");
+#endif
+        return;
+    }
+    pos = _lowerBound(key);
+    memmove(&_handleTab[pos + 1], &_handleTab[pos], (_handleCount - pos) * sizeof(HandleEntry_t));
+    _handleTab[pos].key = key;
+    _handleTab[pos].dac = this;
+    _handleCount++;
+}
+
+// (re)build this accessory's entries in the handle index
+void DiscoveredAccCli::_index()
+{
+    int j = 0;
+    
+    // remove any existing entries
+    for (int i = 0; i < _handleCount; i++)
+    {
+        if (_handleTab[i].dac != this)
         {
-            Serial.print("Start DA read error(next):");
-            Serial.println(bleErr);
+            _handleTab[j++] = _handleTab[i];
         }
-#endif
-        return(bleErr == BLE_ERROR_NONE);
     }
-    else
+    _handleCount = j;
+    if (_connHandle != NO_CONN_HANDLE)
     {
-        // reconnecting
-        // issue read for the state characteristic
-        return(_stateDC.read() == BLE_ERROR_NONE);
+        _addHandle(_stateHandle);
+        _addHandle(_cmdHandle);
+        _addHandle(_stateCCCDHandle);
     }
+}
+
+/**
+ @brief Find a discovered accessory by handle
+ 
+ This looks up the discovered accessory that owns an attribute on a connection.  The state, command and state CCCD
+ handles are indexed.
+ 
+ @param ch - connection handle
+ @param h - attribute handle
+ 
+ @return pointer to the discovered accessory or nullptr if none
+ */
+DiscoveredAccCli* DiscoveredAccCli::findByHandle(ble::connection_handle_t ch, GattAttribute::Handle_t h)
+{
+    uint32_t key = handleKey(ch, h);
+    int pos = _lowerBound(key);
     
+    if ((pos < _handleCount) && (_handleTab[pos].key == key))
+    {
+        return(_handleTab[pos].dac);
+    }
+    return(nullptr);
 }
+
+// notification dispatcher - pass it to the accessory that owns the handle
+void DiscoveredAccCli::_onHVX(const GattHVXCallbackParams* cbp)
+{
+    DiscoveredAccCli* dac = findByHandle(cbp->connHandle, cbp->handle);
+    if (dac != nullptr)
+    {
+        dac->_dataChange(cbp);
+    }
+}
+
 /**
  @brief Update the Client Characteristic Configuration Descriptor
  
  This initiates a write to Characteristic Configuration Descriptor to mark that this client requires
  notifications when the state desciptor value is changed at the server.
  
- @return bool true if initiating the write was successfull.
+ @return BLE error code - BLE_ERROR_NONE if the write was initiated, BLE_ERROR_INVALID_PARAM if
+ there is no CCCD.
  */
 
 
-bool DiscoveredAccCli::doCCCDwrite()
+ble_error_t DiscoveredAccCli::doCCCDwrite()
 {
-    ble_error_t bleErr;
+    ble_error_t bleErr = BLE_ERROR_INVALID_PARAM;
     GattAttribute::Handle_t h = _stateCCCDHandle;
   //  const uint16_t hvNotification = BLE_HVX_NOTIFICATION;
     uint16_t hvNotification = 1;
@@ -178,7 +360,7 @@ bool DiscoveredAccCli::doCCCDwrite()
     if (h != GattAttribute::INVALID_HANDLE)
     {
         // if OK we will get a write callback
-        bleErr = _gattClient.write(
+        bleErr = BLE::Instance().gattClient().write(
                                    GattClient::GATT_OP_WRITE_REQ,
                                    _connHandle,
                                    h,
@@ -199,8 +381,7 @@ bool DiscoveredAccCli::doCCCDwrite()
         }
 #endif
     }
-    return((h != GattAttribute::INVALID_HANDLE) &&
-           (bleErr == BLE_ERROR_NONE));
+    return(bleErr);
 }
 
 
@@ -208,9 +389,10 @@ bool DiscoveredAccCli::doCCCDwrite()
  @brief Save a discovered characteristic.
  
  If the discovered characteristic UUID matches one those known to us and identifies the discovered characteristic
- as being one that is of interest, it is saved as part of the discovered
- accessory.   The characteristics saved are the id, the state and command.  Discovered characteristics are saved as
- shallow copies.
+ as being one that is of interest, its value handle is saved as part of the discovered
+ accessory.   The characteristics saved are the id, the state and command.  The discovered characteristics
+ themselves are not kept - the state characteristic is needed for descriptor discovery so the caller keeps it
+ until that's done.
  
  @param c - pointer to the discovered characteristic.
  
@@ -232,7 +414,7 @@ uuid_t DiscoveredAccCli::saveCharacteristic(const DiscoveredCharacteristic* c)
     switch (u)
     {
         case ID_UUID:
-            _idDC = *c;
+            _idHandle = c->getValueHandle();
 #if DEBUG
             if (!c->getProperties().read())
             {
@@ -243,7 +425,8 @@ uuid_t DiscoveredAccCli::saveCharacteristic(const DiscoveredCharacteristic* c)
             break;
             
         case STATE_UUID:
-            _stateDC = *c;
+            _stateHandle = c->getValueHandle();
+            _setHVX();
 #if DEBUG
             if (!c->getProperties().notify())
             {
@@ -253,7 +436,8 @@ uuid_t DiscoveredAccCli::saveCharacteristic(const DiscoveredCharacteristic* c)
             break;
             
         case CMD_UUID:
-            _commandDC = *c;
+            _cmdHandle = c->getValueHandle();
+            _cmdNoRsp = c->getProperties().writeWoResp();
 #if DEBUG
             if (!c->getProperties().write())
             {
@@ -269,6 +453,7 @@ uuid_t DiscoveredAccCli::saveCharacteristic(const DiscoveredCharacteristic* c)
 #endif
             break;
     }
+    _index();
     return(u);
 }
 
@@ -276,26 +461,27 @@ uuid_t DiscoveredAccCli::saveCharacteristic(const DiscoveredCharacteristic* c)
  @brief Read Id of discovered accessory
  
  This issues the BLE command to read the value of the ID characteristic as discovered and held as part of the
- discovered accessory.
+ discovered accessory.  The read is issued on the current connection handle rather than the one held by the discovered
+ characteristic which may be stale after reconnection.
  
  @return BLE error code - BLE_ERROR_NONE if OK
  */
 ble_error_t DiscoveredAccCli::readId()
 {
-    return(_idDC.read());
+    return(BLE::Instance().gattClient().read(_connHandle, _idHandle, 0));
 }
 
 /**
  @brief Read State of discovered accessory
  
  This issues the BLE command to read the value of the state characteristic as discovered and held as part of the
- discovered accessory.
+ discovered accessory.  The read is issued on the current connection handle.
  
  @return BLE error code - BLE_ERROR_NONE if OK
  */
 ble_error_t DiscoveredAccCli::readState()
 {
-    return(_stateDC.read());
+    return(BLE::Instance().gattClient().read(_connHandle, _stateHandle, 0));
 }
 
 
@@ -308,7 +494,7 @@ ble_error_t DiscoveredAccCli::readState()
  */
 GattAttribute::Handle_t DiscoveredAccCli::idValueHandle()
 {
-    return(_idDC.getValueHandle());
+    return(_idHandle);
 }
 
 /**
@@ -328,9 +514,9 @@ bool DiscoveredAccCli::dataWritten(const GattWriteCallbackParams* cbp)
     {
         // it's the right connection
         found =  ((cbp->handle == _stateCCCDHandle) ||
-                (cbp->handle == _commandDC.getValueHandle()) ||
-                  (cbp->handle == _idDC.getValueHandle()) ||     // not writeable but mine
-                  (cbp->handle == _stateDC.getValueHandle()));   // not writeable but mine
+                (cbp->handle == _cmdHandle) ||
+                  (cbp->handle == _idHandle) ||     // not writeable but mine
+                  (cbp->handle == _stateHandle));   // not writeable but mine
     }
     return(found);
 }
@@ -341,15 +527,14 @@ bool DiscoveredAccCli::dataWritten(const GattWriteCallbackParams* cbp)
  A characteristic value has changed at the server and the change has
  been pushed to us here.  The characteristic has to have notify or indicate
  properties set. We have to have requested notifications or indications as
- appropriate.  All notifications will callback here. We have to check it's for
- one of our characteristics - at the moment just the state characteristic
+ appropriate.  Notifications are passed here by the dispatcher if the handle is one of ours.
+ We have to check it's for the right characteristic - at the moment just the state characteristic
  
  @param cbp - pointer to the structure holding parameters as passed to the callback routing
  */
 
 void DiscoveredAccCli::_dataChange(const GattHVXCallbackParams* cbp)
 {
-    ble_error_t bleErr;
 #if DEBUG
     Serial.print("Change - id:");
     Serial.print( getId());
@@ -372,7 +557,7 @@ void DiscoveredAccCli::_dataChange(const GattHVXCallbackParams* cbp)
     // at the moment we only expect notifications for state changes
     
     if ((cbp->connHandle == _connHandle) &&  // check it's our connection
-        (cbp->handle == _stateDC.getValueHandle())) // and state value changed
+        (cbp->handle == _stateHandle)) // and state value changed
     {
         //
         newState((PointState_t)(*(cbp->data)));  // execute virtual function
@@ -389,18 +574,20 @@ void DiscoveredAccCli::_dataChange(const GattHVXCallbackParams* cbp)
  expect to receive notification when the value changes at the server as we need the handle for the CCCD to
  request the notifications.
  
+ @param stateDC - the state characteristic as discovered
  @param cb - the callback to be executed once characteristic description discovery is complete.
  
- @return the BLE error code (always none)
+ @return the BLE error code from initiating descriptor discovery
  */
 ble_error_t DiscoveredAccCli::processDescrips
 (
+ const DiscoveredCharacteristic& stateDC,
  mbed::Callback<void()> cb
  )
 {
     _descripsDoneCB = cb;  // save callback for when we're done
     _stateCCCDHandle = GattAttribute::INVALID_HANDLE;  // set invalid
-    _stateDC.discoverDescriptors
+    return(stateDC.discoverDescriptors
     (
      CharacteristicDescriptorDiscovery::DiscoveryCallback_t
      (
@@ -410,42 +597,33 @@ ble_error_t DiscoveredAccCli::processDescrips
      (
       this,
       &DiscoveredAccCli::_ddDone)
-     );
-    
-    return(BLE_ERROR_NONE);
+     ));
 }
 
 
 
 
-/**
- @brief Save  the service UUID
- 
- This saves the service UUID for this accessory server
- 
- @param u - service UUID
- */
-void DiscoveredAccCli::setConServUUID(UUID u)
-{
-  //  _clientCon = con;  // save owning connection
-    _serviceUUID = u;
-}
 /**
  @brief Exposes the service UUID
  
- This exposes the service UUID associated with this Discovererd Accessory.
+ This exposes the service UUID associated with this Discovererd Accessory.  All accessory services
+ share the same UUID so it isn't held per accessory.
  
  @return the service UUID
  */
 UUID DiscoveredAccCli::getServUUID()
 {
-    return(_serviceUUID);
+    return(BLEcore::getServUUID());
 }
 /**
  @brief Write command to a discovered accessory
  
  This sends a command to a discovered accessory.  The command is sent by writing to the
- value of the accessory's command characteristic. The write is initiated here.  The server response to
+ value of the accessory's command characteristic. The write is initiated here.
+ 
+ If the command characteristic allows write without response, the command is sent with a new sequence number
+ and no response is expected.  The state notification that follows is the acknowledgement.  Several commands may be
+ sent in one connection event.  Otherwise a write request is used and the server response to
  the write is processed later via the connection 'onDataWritten' callback.
  
  @param cmd - command character to be written
@@ -454,9 +632,53 @@ UUID DiscoveredAccCli::getServUUID()
  
  */
 bool DiscoveredAccCli::writeCommand(const uint8_t cmd)
+{
+    if (++_cmdSeq == 0)
+    {
+        _cmdSeq = 1;  // 0 is not used
+    }
+    _cmdValue[0] = cmd;
+    _cmdValue[1] = _cmdSeq;
+    return(_sendCommand());
+}
+
+/**
+ @brief Repeat the last command
+ 
+ This resends the last command with the same sequence number, e.g. if the state hasn't changed as expected.  If
+ the server did get the first one, the repeat is discarded.  Only useful with write without response.
+ 
+ @return true if write initiated successfully
+ */
+bool DiscoveredAccCli::resendCommand()
+{
+    if (!_cmdNoRsp || (_cmdSeq == 0))
+    {
+        return(false);
+    }
+    return(_sendCommand());
+}
+
+// write the command value
+bool DiscoveredAccCli::_sendCommand()
 {
     ble_error_t bleErr;
-    bleErr = _commandDC.write(1, &cmd);
+    if (_cmdNoRsp)
+    {
+        bleErr = BLE::Instance().gattClient().write(GattClient::GATT_OP_WRITE_CMD,
+                                   _connHandle,
+                                   _cmdHandle,
+                                   sizeof(_cmdValue),
+                                   _cmdValue);
+    }
+    else
+    {
+        bleErr = BLE::Instance().gattClient().write(GattClient::GATT_OP_WRITE_REQ,
+                                   _connHandle,
+                                   _cmdHandle,
+                                   1,
+                                   _cmdValue);
+    }
 #if DEBUG
     if (bleErr != BLE_ERROR_NONE)
     {
@@ -482,6 +704,7 @@ void DiscoveredAccCli::_descripDisc
     {
         // save the handle so we can write to it
         _stateCCCDHandle = cbp->descriptor.getAttributeHandle();
+        _index();
 #if DEBUG
         Serial.print("     CCCD handle ");
         Serial.println(_stateCCCDHandle);
@@ -504,16 +727,8 @@ void DiscoveredAccCli::_ddDone
         
     }
 #endif
-    if (_stateCCCDHandle != GattAttribute::INVALID_HANDLE)
-    {
-//        if(!_doCCCDwrite())
-        if(_stateDC.read() != BLE_ERROR_NONE)
-        {
-            // if error finished discovery for this write
-            _descripsDoneCB();
-        }
-    }
-    
+    // the state read and CCCD write follow on from the remote device's queue
+    _descripsDoneCB();
 }
 
 /**
@@ -529,6 +744,36 @@ ble::connection_handle_t DiscoveredAccCli::getConnHandle()
 }
 
 
+/**
+ @brief Expose the value handle for the command characteristic
+ 
+ @return the handle of the command characteristic value.
+ */
+GattAttribute::Handle_t DiscoveredAccCli::cmdValueHandle()
+{
+    return(_cmdHandle);
+}
+
+/**
+ @brief Check if commands are sent without response
+ 
+ @return true if the command characteristic allows write without response
+ */
+bool DiscoveredAccCli::cmdNoRsp()
+{
+    return(_cmdNoRsp);
+}
+
+/**
+ @brief Expose the handle for the state characteristic's CCCD
+ 
+ @return the CCCD handle - INVALID_HANDLE if not discovered.
+ */
+GattAttribute::Handle_t DiscoveredAccCli::stateCCCDHandle()
+{
+    return(_stateCCCDHandle);
+}
+
 /**
  @brief Expose the value handle for the state characteristic
  
@@ -537,7 +782,7 @@ ble::connection_handle_t DiscoveredAccCli::getConnHandle()
  */
 GattAttribute::Handle_t DiscoveredAccCli::stateValueHandle()
 {
-    return(_stateDC.getValueHandle());
+    return(_stateHandle);
 }
 
-
+#endif /* DAWS_CENTRAL */
@@ -27,6 +27,9 @@
 #ifndef ____dawsDiscCli__
 #define ____dawsDiscCli__
 
+class BLERemDev;
+
+#define MAX_CLI_HANDLES (3 * MAX_DISCOVERED_ACCESSORY * MAX_REMOTE_CON) ///< handle index size - state, command and CCCD per accessory
 
 /**
  @brief The client accessory as discovered as part of BLE service discovery.
@@ -42,7 +45,8 @@
  
  This class holds the accessory information as discovered before the id of the accessory is read and
  therefore before it can be linked
- to an accessory as configured.
+ to an accessory as configured.  Only the attribute handles and connection handle are held, so that many
+ accessories can be tracked.
  
  Once the accessory has been discovered, it is retained if the connection is closed. Re-discovery is not performed
  when the connection is re-established.  The accessory persists until power off.  It is assumed that the service will not
@@ -58,26 +62,33 @@ class DiscoveredAccCli: public Reporter
 {
 public:
     DiscoveredAccCli();
-    DiscoveredAccCli(ble::connection_handle_t, UUID);
+    DiscoveredAccCli(ble::connection_handle_t);
     ReporterType getType() override;
-    void initSvr(ble::connection_handle_t, UUID);
-    bool initCharacteristics(RemDevState_t);
-    //BLERemDev* getConnection();
+    void initSvr(ble::connection_handle_t);
+    void restoreHandles(GattAttribute::Handle_t, GattAttribute::Handle_t,
+                        GattAttribute::Handle_t, GattAttribute::Handle_t, bool);
+    void setConnection(BLERemDev*, ble::connection_handle_t);
+    BLERemDev* getConnection();
+    DiscoveredAccCli* getNextOnConn();
+    void setNextOnConn(DiscoveredAccCli*);
     UUID getServUUID();
-    void setConServUUID(UUID);
     uuid_t saveCharacteristic(const DiscoveredCharacteristic*);
     ble_error_t readId();
     ble_error_t readState();
     
     GattAttribute::Handle_t idValueHandle();
-    //GattAttribute::Handle_t stateCCCDHandle();
+    GattAttribute::Handle_t stateCCCDHandle();
     GattAttribute::Handle_t stateValueHandle();
+    GattAttribute::Handle_t cmdValueHandle();
     
     bool writeCommand(const uint8_t);
-    ble_error_t processDescrips(mbed::Callback<void()>);
+    bool resendCommand();
+    bool cmdNoRsp();
+    ble_error_t processDescrips(const DiscoveredCharacteristic&, mbed::Callback<void()>);
     bool dataWritten(const GattWriteCallbackParams*);
     ble::connection_handle_t getConnHandle();
-    bool doCCCDwrite();
+    ble_error_t doCCCDwrite();
+    static DiscoveredAccCli* findByHandle(ble::connection_handle_t, GattAttribute::Handle_t);
     
 
     virtual void newState(PointState_t) = 0;  ///< state has changed  - inheriting class must process it
@@ -86,10 +97,9 @@ public:
  
 private:
     static const ReporterType _type; // reporter type
-    ble::GattClient& _gattClient = BLE::Instance().gattClient();  // reference gattClient
-    // discovered service paramaters (shallow copy is not supported)
-    UUID _serviceUUID;
     ble::connection_handle_t _connHandle;  // connection handle
+    BLERemDev* _remDev;                    // owning connection
+    DiscoveredAccCli* _nextOnConn;         // next accessory on the owning connection
     
     // standard mbed BLE callbacks for discription discovery
     // discription discovery complete
@@ -98,13 +108,33 @@ private:
 
     mbed::Callback<void()> _descripsDoneCB; // call back executed when complete here
 
-    // discovered service characteristics (shallow copies)
-    DiscoveredCharacteristic _idDC;
-    DiscoveredCharacteristic _stateDC;
-    DiscoveredCharacteristic _commandDC;
+    // handles only - reads and writes go straight to the GATT client
     GattAttribute::Handle_t _stateCCCDHandle;  // state characteristic's CCCD handle
+    // value handles - from discovery or restored from the handle cache
+    GattAttribute::Handle_t _idHandle;       // id characteristic value handle
+    GattAttribute::Handle_t _stateHandle;    // state characteristic value handle
+    GattAttribute::Handle_t _cmdHandle;      // command characteristic value handle
+    bool _cmdNoRsp;          // command characteristic allows write without response
+    uint8_t _cmdSeq;         // sequence number of the last command sent
+    uint8_t _cmdValue[2];    // last command sent - command and sequence number
+    bool _sendCommand();
     
+    void _setHVX();
     void _dataChange(const GattHVXCallbackParams*);
+    
+    // handle index - sorted on connection and attribute handle for notification and write response dispatch
+    struct HandleEntry_t
+    {
+        uint32_t key;            // connection handle << 16 | attribute handle
+        DiscoveredAccCli* dac;   // owning discovered accessory
+    };
+    static HandleEntry_t _handleTab[];
+    static int _handleCount;
+    static bool _hvxSet;    // set once the notification dispatcher is registered
+    static int _lowerBound(uint32_t);
+    static void _onHVX(const GattHVXCallbackParams*);
+    void _addHandle(GattAttribute::Handle_t);
+    void _index();
     void _dataRead(const GattReadCallbackParams*);
 };
 
@@ -49,6 +49,15 @@
 
 #define DEBUG false  ///< enable BLE debug output to IDE Monitor
 
+#if DAWS_CENTRAL  // remote accessories are central only
+
+// id index - open addressed on the accessory id
+RemAccessory* RemAccessory::_idTab[ID_TABLE_SIZE];
+int RemAccessory::_idCount = 0;
+
+static_assert((ID_TABLE_SIZE & (ID_TABLE_SIZE - 1)) == 0, "id index size must be a power of 2");
+static_assert(ID_TABLE_SIZE > ACC_POOL_SIZE, "id index must always have a free slot");
+static_assert(MAX_ID_SIZE > 1, "ids need room for the terminator");
 
 
 
@@ -71,50 +80,152 @@ RemAccessory::RemAccessory(char* id)
         _remAccId[MAX_ID_SIZE - 1] = '\0';
     }
     _reportedState = P_UNAVAIL;  // we won't be connected yet!
+    _indexId();
 }
 
 /**
  @brief Construct the Remote Accessory object
  
- This constructs the remote accessory using the suppled connection handle and service UUID.
+ This constructs the remote accessory using the suppled connection handle.
  Further information is added during discovery.
  
  @param ch - connection handle
- @param uuid - The service UUID.
  */
-RemAccessory::RemAccessory(ble::connection_handle_t ch, UUID uuid):
-DiscoveredAccCli(ch, uuid)
+RemAccessory::RemAccessory(ble::connection_handle_t ch):
+DiscoveredAccCli(ch)
 {
+    _remAccId[0] = '\0';  // id not read yet
     _reportedState = P_UNAVAIL;  // we won't be fully discovered yet!
 }
 
 
+/*
+ ********************************************************
+ 
+ Id index
+ 
+ Remote accessories are indexed on their id in an open addressed table with linear probing.  The index is
+ filled when the id is set, i.e. when it is read as part of discovery or restored from the handle cache.  If
+ an accessory is rediscovered (e.g. after a stale handle cache) the most recent accessory with the id replaces
+ the earlier one.
+ 
+ ********************************************************
+ */
+
+// FNV-1a hash of the id - returns the home slot
+static unsigned int idHash(const char* id)
+{
+    uint32_t h = 2166136261UL;  // FNV offset basis
+    
+    while (*id != '\0')
+    {
+        h = (h ^ (uint8_t)*id++) * 16777619UL;  // FNV prime
+    }
+    return(h & (ID_TABLE_SIZE - 1));
+}
+
+// find the slot holding the id or the empty slot where it would go
+unsigned int RemAccessory::_findSlot(const char* id)
+{
+    unsigned int slot = idHash(id);
+    
+    while ((_idTab[slot] != nullptr) &&
+           (strncmp(_idTab[slot]->_remAccId, id, MAX_ID_SIZE) != 0))
+    {
+        slot = (slot + 1) & (ID_TABLE_SIZE - 1);
+    }
+    return(slot);
+}
+
+// add this accessory to the index under its id
+void RemAccessory::_indexId()
+{
+    unsigned int slot;
+    
+    if (_remAccId[0] == '\0')
+    {
+        return;  // no id yet
+    }
+    slot = _findSlot(_remAccId);
+    if (_idTab[slot] == nullptr)
+    {
+        if (_idCount >= ID_TABLE_SIZE - 1)
+        {
+#if DEBUG
+            Serial.println("Id index full");
+#endif
+            return;  // keep one slot empty so searches terminate
+        }
+        _idCount++;
+    }
+    _idTab[slot] = this;
+}
+
+// remove this accessory from the index - backward shift deletion so no tombstones are needed
+void RemAccessory::_unindexId()
+{
+    unsigned int slot;
+    unsigned int next;
+    unsigned int home;
+    
+    if (_remAccId[0] == '\0')
+    {
+        return;
+    }
+    slot = _findSlot(_remAccId);
+    if (_idTab[slot] != this)
+    {
+        return;  // not indexed or replaced by a later one
+    }
+    _idTab[slot] = nullptr;
+    _idCount--;
+    next = (slot + 1) & (ID_TABLE_SIZE - 1);
+    while (_idTab[next] != nullptr)
+    {
+        home = idHash(_idTab[next]->_remAccId);
+        // move the entry back if the empty slot lies between its home and where it is
+        if (((next - home) & (ID_TABLE_SIZE - 1)) >= ((next - slot) & (ID_TABLE_SIZE - 1)))
+        {
+            _idTab[slot] = _idTab[next];
+            _idTab[next] = nullptr;
+            slot = next;
+        }
+        next = (next + 1) & (ID_TABLE_SIZE - 1);
+    }
+}
+
 /**
  @brief Find Remote Accessory by its id
  
- This searches the through the reporter linkage looking for a remote accessory with the supplied id. If not found
- nullptr is returned.
+ This looks up the remote accessory with the supplied id in the id index. If not found
+ nullptr is returned.  Nothing is allocated.
  
- @param id - the remote accessory id as a String
+ @param id - the remote accessory id
  
  @return pointer the remote accessory
  */
 
-RemAccessory* RemAccessory::findRemAccById(const String id)
+RemAccessory* RemAccessory::findRemAccById(const char* id)
 {
-    Reporter* nextReporter = Reporter::getFirstReporter();
-    while ((nextReporter != nullptr) && // not last and
-           // match conditions: type is Remote Accessory
-           // strings match
-           ((nextReporter->getType() != RA_REP) || //
-            (String(((RemAccessory*)nextReporter)->getRemAccId()) == id)))
-    {
-        // no match - look at next one
-        nextReporter = nextReporter->getNextReporter();
-    }
-    return ((RemAccessory*)nextReporter);
+    return(_idTab[_findSlot(id)]);
 }
 
+#if DAWS_STRING_API
+/**
+ @brief Find Remote Accessory by its id
+ 
+ As above, with the id as a String.
+ 
+ @param id - the remote accessory id as a String
+ 
+ @return pointer the remote accessory
+ */
+RemAccessory* RemAccessory::findRemAccById(const String& id)
+{
+    return(findRemAccById(id.c_str()));
+}
+#endif
+
 /**
  @brief Set the point
  
@@ -220,7 +331,11 @@ const char* RemAccessory::getRemAccId()
  */
 void RemAccessory::setRemAccId(const uint8_t* id, uint16_t len)
 {
+    _unindexId();  // in case it's changed
     // if string is too long (it shouldn't be) it's truncated
     memcpy(_remAccId, id, (len >= MAX_ID_SIZE)?MAX_ID_SIZE - 1:len);
     _remAccId[(len >= MAX_ID_SIZE)?MAX_ID_SIZE - 1:len] = '\0';  // terminate string
+    _indexId();
 }
+
+#endif /* DAWS_CENTRAL */
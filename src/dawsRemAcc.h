@@ -27,6 +27,7 @@
 #ifndef ____dawsRemAcc__
 #define ____dawsRemAcc__
 
+// ID_TABLE_SIZE is set in dawsConfig.h
 
 
 /**
@@ -46,7 +47,7 @@ class RemAccessory: public DiscoveredAccCli
 public:
     RemAccessory();
     RemAccessory(char*);
-    RemAccessory(ble::connection_handle_t, UUID);
+    RemAccessory(ble::connection_handle_t);
 
     const char* getRemAccId();
     void setRemAccId(const uint8_t*, uint16_t);
@@ -56,11 +57,21 @@ public:
     void setState(PointState_t) override;
     PointState_t getState();
     
-    static RemAccessory* findRemAccById(const String);
+    static RemAccessory* findRemAccById(const char*);
+#if DAWS_STRING_API
+    static RemAccessory* findRemAccById(const String&);
+#endif
     
 private:
     char _remAccId[MAX_ID_SIZE];  // name of the associated Remote Accessory service
     
+    // id index - open addressed on the id
+    static RemAccessory* _idTab[];
+    static int _idCount;
+    static unsigned int _findSlot(const char*);
+    void _indexId();
+    void _unindexId();
+    
     PointPos_t _cmd;         // last received command
     PointState_t _reportedState;    // the reported state
 };